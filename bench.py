@@ -0,0 +1,259 @@
+#!/usr/bin/env python
+
+"""Strong and weak scaling benchmarks for d2q9-bgk.
+
+Strong scaling runs each of the given grids on each of the given numbers of
+processes. Weak scaling stacks copies of a base grid vertically, one per
+process, so every process has the same number of cells. Every run is
+checked with check/d2q9-check: against the reference results in check/ for
+the standard grids and the weak scaling base grid on one process, or, as
+the generated weak scaling grids have none, against a run of the same input
+on the fewest processes, or on one for the runs on the fewest. A table of
+times, MLUPS (million lattice updates per second) and parallel efficiency
+is printed and written as CSV.
+"""
+
+import argparse
+import os
+import re
+import shlex
+import subprocess
+import sys
+
+ROOT = os.path.dirname(os.path.abspath(__file__))
+CHECK = os.path.join(ROOT, "check")
+
+
+def parse_args():
+    parser = argparse.ArgumentParser(
+        description="Scaling benchmarks for d2q9-bgk",
+        formatter_class=argparse.ArgumentDefaultsHelpFormatter,
+        )
+    parser.add_argument("--exe", default=os.path.join(ROOT, "d2q9-bgk"),
+        help="""executable to benchmark""")
+    parser.add_argument("--ranks", nargs="+", type=int, default=[1, 2, 4],
+        help="""numbers of processes to run on""")
+    parser.add_argument("--grids", nargs="*",
+        default=["128x128", "128x256", "256x256"],
+        help="""grids for strong scaling, from input_<grid>.params""")
+    parser.add_argument("--weak-grid", default="128x128",
+        help="""base grid for weak scaling, none to skip it""")
+    parser.add_argument("--weak-iters", type=int, default=None,
+        help="""timesteps of the weak scaling runs, default as the base""")
+    parser.add_argument("--launcher", default="mpirun -np {ranks}",
+        help="""command to start a run on {ranks} processes""")
+    parser.add_argument("--threads", type=int, default=1,
+        help="""OMP_NUM_THREADS for each process""")
+    parser.add_argument("--checker", default=os.path.join(CHECK, "d2q9-check"),
+        help="""result checker, from make check/d2q9-check""")
+    parser.add_argument("--tolerance", type=float, default=1.0,
+        help="""percentage tolerance passed to the checker""")
+    parser.add_argument("--out-dir", default="bench_runs",
+        help="""directory to run in, one subdirectory per run""")
+    parser.add_argument("--csv", default="scaling.csv",
+        help="""file to write the scaling table to""")
+    return parser.parse_args()
+
+
+def read_params(filename):
+    with open(filename) as params:
+        return params.read().split()
+
+
+def cells(grid):
+    nx, ny = grid.split("x")
+    return int(nx) * int(ny)
+
+
+def make_weak_input(args, ranks):
+    """Write the input files for the weak scaling grid on ranks processes,
+    the base grid stacked ranks times in y, and return their names."""
+    base = read_params(os.path.join(ROOT, "input_%s.params" % args.weak_grid))
+    nx, ny = int(base[0]), int(base[1])
+    grid = "%dx%d" % (nx, ny * ranks)
+    directory = os.path.join(args.out_dir, "weak-input-%s" % grid)
+    paramfile = os.path.join(directory, "input_%s.params" % grid)
+    obstaclefile = os.path.join(directory, "obstacles_%s.dat" % grid)
+
+    if not os.path.isdir(directory):
+        os.makedirs(directory)
+
+    params = [str(nx), str(ny * ranks)] + base[2:]
+    if args.weak_iters is not None:
+        params[2] = str(args.weak_iters)
+
+    with open(paramfile, "w") as out:
+        out.write("\n".join(params) + "\n")
+
+    with open(os.path.join(ROOT, "obstacles_%s.dat" % args.weak_grid)) as obs:
+        blocked = [line.split() for line in obs if line.strip()]
+
+    with open(obstaclefile, "w") as out:
+        for copy in range(ranks):
+            for xx, yy, value in blocked:
+                out.write("%s %d %s\n" % (xx, int(yy) + copy * ny, value))
+
+    return grid, paramfile, obstaclefile
+
+
+def run(args, name, ranks, paramfile, obstaclefile):
+    """Run the executable in its own directory, returning the directory and
+    the elapsed time, or None if it failed."""
+    directory = os.path.abspath(os.path.join(args.out_dir, name))
+
+    if not os.path.isdir(directory):
+        os.makedirs(directory)
+
+    command = shlex.split(args.launcher.format(ranks=ranks)) + [
+        os.path.abspath(args.exe), os.path.abspath(paramfile),
+        os.path.abspath(obstaclefile)]
+    env = dict(os.environ, OMP_NUM_THREADS=str(args.threads))
+
+    sys.stdout.write("%-32s " % name)
+    sys.stdout.flush()
+
+    with open(os.path.join(directory, "d2q9-bgk.out"), "w") as out:
+        status = subprocess.call(command, cwd=directory, env=env, stdout=out,
+                                 stderr=subprocess.STDOUT)
+
+    with open(os.path.join(directory, "d2q9-bgk.out")) as out:
+        elapsed = re.search(r"Elapsed time:\s+([0-9.]+)", out.read())
+
+    if status != 0 or elapsed is None:
+        print("run failed, see %s" % os.path.join(directory, "d2q9-bgk.out"))
+        return directory, None
+
+    print("%10.3f s" % float(elapsed.group(1)))
+    return directory, float(elapsed.group(1))
+
+
+def final_state(prefix):
+    """The final state file prefix + .bin, or the text one if there is no
+    binary file, as the checker reads either."""
+    if os.path.exists(prefix + ".bin"):
+        return prefix + ".bin"
+    return prefix + ".dat"
+
+
+def check(args, directory, ref_av_vels, ref_final_state):
+    """Check the results of a run with the checker."""
+    status = subprocess.call(
+        [args.checker,
+         "--tolerance=%g" % args.tolerance,
+         "--ref-av-vels-file=%s" % ref_av_vels,
+         "--ref-final-state-file=%s" % final_state(ref_final_state),
+         "--av-vels-file=%s" % os.path.join(directory, "av_vels.dat"),
+         "--final-state-file=%s" %
+         final_state(os.path.join(directory, "final_state"))],
+        stdout=open(os.path.join(directory, "check.out"), "w"),
+        stderr=subprocess.STDOUT)
+    return "PASS" if status == 0 else "FAIL"
+
+
+def check_weak(args, references, fewest, ranks, grid, directory, paramfile,
+               obstaclefile):
+    """Check a weak scaling run. On one process the grid is the base grid,
+    checked against its reference results in check/ unless --weak-iters
+    changed the run. There are no reference results for the other generated
+    grids, so the run on the fewest processes is checked against one on a
+    single process, and the others against a run of the same grid on the
+    fewest processes, made once per grid and kept in references."""
+    if ranks == fewest:
+        base = os.path.join(ROOT, "input_%s.params" % args.weak_grid)
+        ref = os.path.join(CHECK, args.weak_grid)
+
+        if ranks == 1:
+            if (read_params(paramfile)[2] != read_params(base)[2] or
+                    not os.path.exists(ref + ".av_vels.dat")):
+                return "-"
+            return check(args, directory, ref + ".av_vels.dat",
+                         ref + ".final_state")
+
+        reference, time = run(args, "weak-%s-1-ref" % grid, 1, paramfile,
+                              obstaclefile)
+    else:
+        if grid not in references:
+            references[grid] = run(args, "weak-%s-%d-ref" % (grid, fewest),
+                                   fewest, paramfile, obstaclefile)
+        reference, time = references[grid]
+
+    if time is None:
+        return "FAIL"
+    return check(args, directory, os.path.join(reference, "av_vels.dat"),
+                 os.path.join(reference, "final_state"))
+
+
+def main():
+    args = parse_args()
+    ranks = sorted(set(args.ranks))
+    rows = []
+
+    for grid in args.grids:
+        paramfile = os.path.join(ROOT, "input_%s.params" % grid)
+        iters = int(read_params(paramfile)[2])
+        base = None
+
+        for n in ranks:
+            directory, time = run(args, "strong-%s-%d" % (grid, n), n,
+                                  paramfile,
+                                  os.path.join(ROOT, "obstacles_%s.dat" % grid))
+            row = {"mode": "strong", "grid": grid, "ranks": n, "time": time,
+                   "mlups": None, "efficiency": None, "check": "FAIL"}
+
+            if time is not None:
+                row["mlups"] = cells(grid) * iters / time / 1e6
+                if base is None:
+                    base = (n, time)
+                row["efficiency"] = base[0] * base[1] / (n * time)
+                row["check"] = check(
+                    args, directory,
+                    os.path.join(CHECK, "%s.av_vels.dat" % grid),
+                    os.path.join(CHECK, "%s.final_state" % grid))
+
+            rows.append(row)
+
+    if args.weak_grid != "none":
+        base = None
+        references = {}
+
+        for n in ranks:
+            grid, paramfile, obstaclefile = make_weak_input(args, n)
+            iters = int(read_params(paramfile)[2])
+            directory, time = run(args, "weak-%s-%d" % (grid, n), n,
+                                  paramfile, obstaclefile)
+            row = {"mode": "weak", "grid": grid, "ranks": n, "time": time,
+                   "mlups": None, "efficiency": None, "check": "FAIL"}
+
+            if time is not None:
+                row["mlups"] = cells(grid) * iters / time / 1e6
+                if base is None:
+                    base = time
+                row["efficiency"] = base / time
+                row["check"] = check_weak(args, references, ranks[0], n,
+                                          grid, directory, paramfile,
+                                          obstaclefile)
+
+            rows.append(row)
+
+    header = ["mode", "grid", "ranks", "time", "mlups", "efficiency", "check"]
+    print("\n%-6s %-10s %6s %12s %10s %10s %6s" % tuple(header))
+
+    with open(args.csv, "w") as out:
+        out.write(",".join(header) + "\n")
+
+        for row in rows:
+            fields = [row["mode"], row["grid"], str(row["ranks"])]
+            for key, form in (("time", "%.6f"), ("mlups", "%.3f"),
+                              ("efficiency", "%.3f")):
+                fields.append("" if row[key] is None else form % row[key])
+            fields.append(row["check"])
+            out.write(",".join(fields) + "\n")
+            print("%-6s %-10s %6s %12s %10s %10s %6s" % tuple(fields))
+
+    if any(row["check"] == "FAIL" for row in rows):
+        print("\nSome runs failed or did not match their reference results")
+        sys.exit(1)
+
+
+if __name__ == "__main__":
+    main()
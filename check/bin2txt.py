@@ -0,0 +1,48 @@
+#!/usr/bin/env python
+
+"""Convert a binary final state file, as written by d2q9-bgk built with
+-DBINARY_OUTPUT, to the text format read by check.py."""
+
+import argparse
+import struct
+
+MAGIC = b"D2Q9BGK\0"
+NAME_LEN = 16
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Convert a binary final state file to text",
+        formatter_class=argparse.ArgumentDefaultsHelpFormatter,
+        )
+    parser.add_argument("binary_file", nargs="?", default="final_state.bin",
+        help="""binary final state file to read""")
+    parser.add_argument("text_file", nargs="?", default="final_state.dat",
+        help="""text final state file to write""")
+    args = parser.parse_args()
+
+    with open(args.binary_file, "rb") as binary:
+        if binary.read(len(MAGIC)) != MAGIC:
+            raise SystemExit("%s is not a final state file" % args.binary_file)
+
+        nx, ny, nfields = struct.unpack("=3i", binary.read(12))
+        names = [binary.read(NAME_LEN).rstrip(b"\0").decode()
+                 for _ in range(nfields)]
+        fields = [names.index(name)
+                  for name in ("u_x", "u_y", "u", "pressure", "obstacle")]
+        row = struct.Struct("=%df" % (nx * nfields))
+
+        with open(args.text_file, "w") as text:
+            for jj in range(ny):
+                values = row.unpack(binary.read(row.size))
+
+                for ii in range(nx):
+                    cell = values[ii * nfields:(ii + 1) * nfields]
+                    u_x, u_y, u, pressure, obstacle = [cell[ff]
+                                                       for ff in fields]
+                    text.write("%d %d %.12E %.12E %.12E %.12E %d\n" %
+                               (ii, jj, u_x, u_y, u, pressure, obstacle))
+
+
+if __name__ == "__main__":
+    main()
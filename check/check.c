@@ -0,0 +1,523 @@
+/*
+** Check the results of d2q9-bgk against reference results, as check.py
+** does, reading the files in parallel with OpenMP: av_vels from the
+** "tt:\tvalue" text of AVVELSFILE, and the pressures of the final state
+** from either the text FINALSTATEFILE or the binary FINALSTATEBINFILE of
+** -DBINARY_OUTPUT, recognised by its magic. The biggest relative
+** difference of each must be within the tolerance, a percentage, e.g.:
+**
+**   ./d2q9-check --ref-av-vels-file=check/128x128.av_vels.dat
+**       --ref-final-state-file=check/128x128.final_state.bin
+**       --av-vels-file=av_vels.dat --final-state-file=final_state.bin
+**
+** With --convert text binary it writes a text final state, such as a
+** reference, in the binary format instead, to be read faster next time.
+*/
+
+#define _POSIX_C_SOURCE 200112L
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+/* the binary final state of d2q9-bgk: a header of STATE_MAGIC, then nx,
+** ny and the no. of fields as int32s and the field names, each padded to
+** STATE_NAME_LEN chars, followed by the fields of every cell as floats,
+** cell by cell in row major order */
+#define STATE_MAGIC "D2Q9BGK"
+#define STATE_FIELDS 5
+#define STATE_NAME_LEN 16
+#define PRESSURE 3 /* the field compared, as by check.py */
+
+/* the fields of every cell of a final state, in file order */
+typedef struct {
+  int nx; /* the grid size, from the header or the coordinates */
+  int ny;
+  long ncells;
+  int* coords;   /* the ii and jj of each cell, as listed in the file */
+  double* fields; /* STATE_FIELDS values per cell */
+} t_state;
+
+/* the largest relative difference of a series from its reference, as
+** reported by check.py */
+typedef struct {
+  long step;      /* where it is */
+  double diff;    /* reference - value there */
+  double percent; /* diff relative to the value, in percent */
+  double value;
+  double ref;
+  double total; /* sum of the absolute differences */
+} t_diff;
+
+/* load the av_vels of a text file into a new array, setting count */
+double* read_av_vels(const char* filename, long* count);
+
+/* load a final state, text or binary */
+int read_state(const char* filename, t_state* state);
+int read_state_text(const char* filename, char* text, long size,
+                    t_state* state);
+int read_state_binary(const char* filename, FILE* fp, t_state* state);
+int write_state_binary(const char* filename, const t_state* state);
+
+/* the biggest difference of count values, stride apart, from their
+** references */
+t_diff compare(const double* ref, const double* values, long count,
+               int stride);
+
+/* whether a difference must fail the check */
+int failed(const t_diff diff, double tolerance);
+
+/* read a whole file into a new buffer, setting size */
+char* read_file(const char* filename, long* size);
+
+void die(const char* message, const char* filename);
+void usage(const char* exe);
+
+int main(int argc, char* argv[]) {
+  const char* ref_av_vels_file = NULL;
+  const char* ref_final_state_file = NULL;
+  const char* av_vels_file = NULL;
+  const char* final_state_file = NULL;
+  double tolerance = 1; /* percent */
+
+  if (argc == 4 && strcmp(argv[1], "--convert") == 0) {
+    t_state state;
+
+    read_state(argv[2], &state);
+    write_state_binary(argv[3], &state);
+    free(state.coords);
+    free(state.fields);
+
+    return EXIT_SUCCESS;
+  }
+
+  /* the options of check.py, with or without the = */
+  for (int aa = 1; aa < argc; aa++) {
+    const char* names[5] = {"--tolerance", "--ref-av-vels-file",
+                            "--ref-final-state-file", "--av-vels-file",
+                            "--final-state-file"};
+    const char* value = NULL;
+    int option;
+
+    for (option = 0; option < 5; option++) {
+      const size_t length = strlen(names[option]);
+
+      if (strncmp(argv[aa], names[option], length) != 0) continue;
+
+      if (argv[aa][length] == '=') {
+        value = argv[aa] + length + 1;
+      } else if (argv[aa][length] == '\0' && aa + 1 < argc) {
+        value = argv[++aa];
+      } else {
+        continue;
+      }
+      break;
+    }
+
+    switch (option) {
+      case 0:
+        tolerance = atof(value);
+        break;
+      case 1:
+        ref_av_vels_file = value;
+        break;
+      case 2:
+        ref_final_state_file = value;
+        break;
+      case 3:
+        av_vels_file = value;
+        break;
+      case 4:
+        final_state_file = value;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+
+  if (ref_av_vels_file == NULL || ref_final_state_file == NULL ||
+      av_vels_file == NULL || final_state_file == NULL) {
+    usage(argv[0]);
+  }
+
+  t_state ref_state;
+  t_state state;
+  long ref_steps;
+  long steps;
+  double* ref_av_vels;
+  double* av_vels;
+
+  /* one at a time, each by all the threads */
+  read_state(ref_final_state_file, &ref_state);
+  read_state(final_state_file, &state);
+  ref_av_vels = read_av_vels(ref_av_vels_file, &ref_steps);
+  av_vels = read_av_vels(av_vels_file, &steps);
+
+  /* make sure the coordinates are in the right order */
+  if (ref_state.ncells != state.ncells ||
+      memcmp(ref_state.coords, state.coords,
+             sizeof(int) * 2 * state.ncells) != 0) {
+    printf("Final state files coordinates were not the same\n");
+    return EXIT_FAILURE;
+  }
+
+  /* make sure the av_vels have the same number of steps */
+  if (ref_steps != steps) {
+    printf("Different number of steps in av_vels files\n");
+    return EXIT_FAILURE;
+  }
+
+  const t_diff av_vels_diff = compare(ref_av_vels, av_vels, steps, 1);
+  const t_diff state_diff =
+      compare(ref_state.fields + PRESSURE, state.fields + PRESSURE,
+              state.ncells, STATE_FIELDS);
+
+  printf("Total difference in av_vels : %.12E\n", av_vels_diff.total);
+  printf("Biggest difference (at step %ld) : %.12E\n", av_vels_diff.step,
+         av_vels_diff.diff);
+  printf("  %.12E vs. %.12E = %.2g%%\n\n", av_vels_diff.value,
+         av_vels_diff.ref, av_vels_diff.percent);
+
+  printf("Total difference in final_state : %.12E\n", state_diff.total);
+  printf("Biggest difference (at coord (%d,%d)) : %.12E\n",
+         state.coords[2 * state_diff.step],
+         state.coords[2 * state_diff.step + 1], state_diff.diff);
+  printf("  %.12E vs. %.12E = %.2g%%\n\n", state_diff.value, state_diff.ref,
+         state_diff.percent);
+
+  const int state_failed = failed(state_diff, tolerance);
+  const int av_vels_failed = failed(av_vels_diff, tolerance);
+
+  if (state_failed) printf("final state failed check\n");
+  if (av_vels_failed) printf("av_vels failed check\n");
+
+  free(ref_state.coords);
+  free(ref_state.fields);
+  free(state.coords);
+  free(state.fields);
+  free(ref_av_vels);
+  free(av_vels);
+
+  if (state_failed || av_vels_failed) return EXIT_FAILURE;
+
+  printf("Both tests passed!\n");
+
+  return EXIT_SUCCESS;
+}
+
+double* read_av_vels(const char* filename, long* count) {
+  long size;
+  char* text = read_file(filename, &size);
+  double* values = malloc(sizeof(double) * (size / 4 + 1));
+  char* line = text;
+
+  if (values == NULL) die("cannot allocate memory for av_vels", filename);
+
+  /* each line is at least "0:\t0\n" long */
+  *count = 0;
+
+  while (line < text + size) {
+    char* end;
+
+    strtol(line, &end, 10);
+    if (end == line || *end != ':') break;
+
+    values[(*count)++] = strtod(end + 1, &end);
+    line = end;
+    while (line < text + size && *line != '\n') line++;
+    line++;
+  }
+
+  free(text);
+
+  return values;
+}
+
+int read_state(const char* filename, t_state* state) {
+  FILE* fp = fopen(filename, "rb");
+  char magic[sizeof(STATE_MAGIC)];
+
+  if (fp == NULL) die("could not open final state file", filename);
+
+  if (fread(magic, 1, sizeof(magic), fp) == sizeof(magic) &&
+      memcmp(magic, STATE_MAGIC, sizeof(magic)) == 0) {
+    read_state_binary(filename, fp, state);
+    fclose(fp);
+  } else {
+    long size;
+    char* text;
+
+    fclose(fp);
+    text = read_file(filename, &size);
+    read_state_text(filename, text, size, state);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int read_state_text(const char* filename, char* text, long size,
+                    t_state* state) {
+  int nthreads = 1;
+
+#ifdef _OPENMP
+  nthreads = omp_get_max_threads();
+#endif
+
+  /* each thread takes the lines starting in its share of the file,
+  ** counting them first to know where to put them */
+  long* counts = calloc(nthreads + 1, sizeof(long));
+
+  if (counts == NULL) die("cannot allocate memory for line counts", filename);
+
+#pragma omp parallel num_threads(nthreads)
+  {
+    int thread = 0;
+
+#ifdef _OPENMP
+    thread = omp_get_thread_num();
+#endif
+
+    char* start = text + size * thread / nthreads;
+    char* end = text + size * (thread + 1) / nthreads;
+
+    /* a line belongs to the thread its first char is in */
+    if (thread > 0) {
+      while (start < text + size && start[-1] != '\n') start++;
+    }
+    while (end < text + size && end[-1] != '\n') end++;
+
+    long lines = 0;
+
+    for (char* cc = start; cc < end; cc++) {
+      if (*cc == '\n' || cc == end - 1) lines++;
+    }
+
+    counts[thread + 1] = lines;
+
+#pragma omp barrier
+#pragma omp single
+    {
+      for (int tt = 0; tt < nthreads; tt++) counts[tt + 1] += counts[tt];
+
+      state->ncells = counts[nthreads];
+      state->coords = malloc(sizeof(int) * 2 * state->ncells);
+      state->fields = malloc(sizeof(double) * STATE_FIELDS * state->ncells);
+
+      if (state->coords == NULL || state->fields == NULL)
+        die("cannot allocate memory for final state", filename);
+    }
+
+    /* "ii jj u_x u_y u pressure obstacle" per cell */
+    long cell = counts[thread];
+
+    for (char* line = start; line < end && cell < counts[thread + 1];
+         cell++) {
+      int* coords = state->coords + 2 * cell;
+      double* fields = state->fields + STATE_FIELDS * cell;
+      char* next;
+
+      coords[0] = (int)strtol(line, &next, 10);
+      coords[1] = (int)strtol(next, &next, 10);
+      for (int ff = 0; ff < STATE_FIELDS; ff++) {
+        fields[ff] = strtod(next, &next);
+      }
+
+      line = next;
+      while (line < end && *line != '\n') line++;
+      line++;
+    }
+  }
+
+  state->nx = 0;
+  state->ny = 0;
+  for (long cell = 0; cell < state->ncells; cell++) {
+    if (state->coords[2 * cell] >= state->nx)
+      state->nx = state->coords[2 * cell] + 1;
+    if (state->coords[2 * cell + 1] >= state->ny)
+      state->ny = state->coords[2 * cell + 1] + 1;
+  }
+
+  free(counts);
+  free(text);
+
+  return EXIT_SUCCESS;
+}
+
+int read_state_binary(const char* filename, FILE* fp, t_state* state) {
+  int32_t dims[3]; /* nx, ny and the no. of fields */
+  char names[STATE_FIELDS][STATE_NAME_LEN];
+
+  if (fread(dims, sizeof(int32_t), 3, fp) != 3 || dims[2] != STATE_FIELDS ||
+      fread(names, sizeof(names), 1, fp) != 1) {
+    die("not a final state file of the expected fields", filename);
+  }
+
+  state->nx = dims[0];
+  state->ny = dims[1];
+  state->ncells = (long)dims[0] * dims[1];
+  state->coords = malloc(sizeof(int) * 2 * state->ncells);
+  state->fields = malloc(sizeof(double) * STATE_FIELDS * state->ncells);
+
+  float* values = malloc(sizeof(float) * STATE_FIELDS * state->ncells);
+
+  if (state->coords == NULL || state->fields == NULL || values == NULL)
+    die("cannot allocate memory for final state", filename);
+
+  if (fread(values, sizeof(float) * STATE_FIELDS, state->ncells, fp) !=
+      (size_t)state->ncells) {
+    die("final state file is too short", filename);
+  }
+
+  /* listed row by row, as the text file is */
+#pragma omp parallel for schedule(static)
+  for (long cell = 0; cell < state->ncells; cell++) {
+    state->coords[2 * cell] = (int)(cell % state->nx);
+    state->coords[2 * cell + 1] = (int)(cell / state->nx);
+
+    for (int ff = 0; ff < STATE_FIELDS; ff++) {
+      state->fields[STATE_FIELDS * cell + ff] =
+          values[STATE_FIELDS * cell + ff];
+    }
+  }
+
+  free(values);
+
+  return EXIT_SUCCESS;
+}
+
+int write_state_binary(const char* filename, const t_state* state) {
+  const char names[STATE_FIELDS][STATE_NAME_LEN] = {"u_x", "u_y", "u",
+                                                    "pressure", "obstacle"};
+  const int32_t dims[3] = {state->nx, state->ny, STATE_FIELDS};
+  FILE* fp;
+
+  /* the binary format has no coordinates, so the cells must be complete
+  ** and in row major order */
+  if (state->ncells != (long)state->nx * state->ny)
+    die("final state is not a whole grid", filename);
+
+  for (long cell = 0; cell < state->ncells; cell++) {
+    if (state->coords[2 * cell] != cell % state->nx ||
+        state->coords[2 * cell + 1] != cell / state->nx) {
+      die("final state is not in row major order", filename);
+    }
+  }
+
+  /* floats, as d2q9-bgk writes */
+  float* values = malloc(sizeof(float) * STATE_FIELDS * state->ncells);
+
+  if (values == NULL) die("cannot allocate memory for final state", filename);
+
+  for (long ii = 0; ii < STATE_FIELDS * state->ncells; ii++) {
+    values[ii] = (float)state->fields[ii];
+  }
+
+  fp = fopen(filename, "wb");
+
+  if (fp == NULL) die("could not open output file", filename);
+
+  if (fwrite(STATE_MAGIC, sizeof(STATE_MAGIC), 1, fp) != 1 ||
+      fwrite(dims, sizeof(dims), 1, fp) != 1 ||
+      fwrite(names, sizeof(names), 1, fp) != 1 ||
+      fwrite(values, sizeof(float) * STATE_FIELDS, state->ncells, fp) !=
+          (size_t)state->ncells) {
+    die("could not write output file", filename);
+  }
+
+  fclose(fp);
+  free(values);
+
+  return EXIT_SUCCESS;
+}
+
+t_diff compare(const double* ref, const double* values, long count,
+               int stride) {
+  t_diff best = {0, 0, 0, 0, 0, 0};
+  double total = 0;
+  double worst = -1; /* the biggest absolute percentage so far */
+
+#pragma omp parallel
+  {
+    t_diff mine = best;
+    double my_worst = -1;
+
+#pragma omp for schedule(static) reduction(+ : total)
+    for (long ii = 0; ii < count; ii++) {
+      const double diff = ref[ii * stride] - values[ii * stride];
+      const double percent = 100.0 * (diff / (ref[ii * stride] - diff));
+      /* like numpy's argmax, the first of the largest, or the first nan */
+      const double size = isnan(percent) ? INFINITY : fabs(percent);
+
+      total += fabs(diff);
+
+      if (size > my_worst) {
+        my_worst = size;
+        mine.step = ii;
+        mine.diff = diff;
+        mine.percent = percent;
+        mine.value = values[ii * stride];
+        mine.ref = ref[ii * stride];
+      }
+    }
+
+    /* the threads took contiguous blocks, so ties go to the earliest */
+#pragma omp critical
+    if (my_worst > worst || (my_worst == worst && mine.step < best.step)) {
+      worst = my_worst;
+      best = mine;
+    }
+  }
+
+  best.total = total;
+
+  return best;
+}
+
+int failed(const t_diff diff, double tolerance) {
+  return !isfinite(diff.percent) || fabs(diff.percent) > tolerance;
+}
+
+char* read_file(const char* filename, long* size) {
+  FILE* fp = fopen(filename, "rb");
+  char* text;
+
+  if (fp == NULL) die("could not open file", filename);
+
+  fseek(fp, 0, SEEK_END);
+  *size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+
+  text = malloc(*size + 1);
+
+  if (text == NULL) die("cannot allocate memory for file", filename);
+
+  if (fread(text, 1, *size, fp) != (size_t)*size)
+    die("could not read file", filename);
+
+  /* so strtod stops at the end */
+  text[*size] = '\0';
+  fclose(fp);
+
+  return text;
+}
+
+void die(const char* message, const char* filename) {
+  fprintf(stderr, "%s: %s\n", filename, message);
+  exit(EXIT_FAILURE);
+}
+
+void usage(const char* exe) {
+  fprintf(stderr,
+          "Usage: %s [--tolerance=percent] --ref-av-vels-file=file "
+          "--ref-final-state-file=file --av-vels-file=file "
+          "--final-state-file=file\n",
+          exe);
+  fprintf(stderr, "   or: %s --convert text_state binary_state\n", exe);
+  exit(EXIT_FAILURE);
+}
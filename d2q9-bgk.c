@@ -45,203 +45,1435 @@
 **
 **   ./d2q9-bgk input.params obstacles.dat
 **
+** and a checkpoint file to restart from may follow them, e.g.:
+**
+**   ./d2q9-bgk input.params obstacles.dat checkpoint.bin
+**
 ** Be sure to adjust the grid dimensions in the parameter file
 ** if you choose a different obstacle file.
 */
 
-#include <math.h>
+#define _POSIX_C_SOURCE 200112L
+#define _DEFAULT_SOURCE /* for MAP_ANONYMOUS and madvise() */
+
+#include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <tgmath.h>
 #include <time.h>
+#include <unistd.h>
+#ifdef STREAM_AV_VELS
+#include <aio.h>
+#include <fcntl.h>
+#endif
+#ifdef __linux__
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
 
 #include "mpi.h"
 
+/* explicit SIMD kernels need the SoA layout of floats and GCC-style target
+** attributes to select instruction sets per function */
+#if defined(SOA) && !defined(NO_SIMD) && !defined(DOUBLE) && \
+    defined(__GNUC__) && defined(__x86_64__)
+#define SIMD_KERNELS
+#include <immintrin.h>
+#endif
+
+/* inline the whole call tree of a function, so that the constants it
+** passes down reach the innermost loops */
+#ifdef __GNUC__
+#define FLATTEN __attribute__((flatten))
+#else
+#define FLATTEN
+#endif
+
 #define NSPEEDS 9
 #define MASTER 0
 #define FINALSTATEFILE "final_state.dat"
 #define AVVELSFILE "av_vels.dat"
+#define FINALSTATEBINFILE "final_state.bin"
+
+/* with -DBINARY_OUTPUT the final state is written by all the processes
+** with MPI-IO, as FINALSTATEBINFILE: a header of STATE_MAGIC, then nx, ny
+** and the no. of fields as int32s and the field names, each padded to
+** STATE_NAME_LEN chars, followed by the fields of every cell as floats,
+** cell by cell in row major order. check/bin2txt.py converts this to
+** FINALSTATEFILE. */
+#define STATE_MAGIC "D2Q9BGK"
+
+/* an obstacle file is either text, one "x y 1" line per blocked cell, or
+** binary as written by obs2bin.py: a header of OBSTACLE_MAGIC, then nx and
+** ny as int32s, followed by a bitmap of ny rows of MAP_WORDS(nx) uint32s,
+** with bit ii % 32 of word ii / 32 of row jj set if cell (ii, jj) is
+** blocked. Only MASTER reads it, and sends each process its rows. */
+#define OBSTACLE_MAGIC "D2Q9OBS"
+#define MAP_WORDS(nx) (((nx) + 31) / 32)
+
+/* with -DCHECKPOINT=N the lattice is saved every N timesteps, by all the
+** processes with MPI-IO, as CHECKPOINTFILE: a header of CHECKPOINT_MAGIC,
+** then nx, ny and the next timestep tt as int32s, followed by av_vels for
+** the first tt timesteps as t_accums and the speeds of every cell as
+** t_reals, cell by cell in row major order. A run given the file restarts
+** from tt. The magic differs between precisions, which can't share files.
+** With -DSTREAM_AV_VELS the av_vels so far are in AVVELSFILE instead, so
+** the checkpoint holds none of them and has a magic of its own. */
+#define CHECKPOINTFILE "checkpoint.bin"
+#if defined(STREAM_AV_VELS) && defined(DOUBLE)
+#define CHECKPOINT_MAGIC "D2Q9SKD"
+#elif defined(STREAM_AV_VELS) && defined(MIXED)
+#define CHECKPOINT_MAGIC "D2Q9SKM"
+#elif defined(STREAM_AV_VELS)
+#define CHECKPOINT_MAGIC "D2Q9SKP"
+#elif defined(DOUBLE)
+#define CHECKPOINT_MAGIC "D2Q9CKD"
+#elif defined(MIXED)
+#define CHECKPOINT_MAGIC "D2Q9CKM"
+#else
+#define CHECKPOINT_MAGIC "D2Q9CKP"
+#endif
+#ifdef STREAM_AV_VELS
+#define CHECKPOINT_AV_VELS(tt) 0
+#else
+#define CHECKPOINT_AV_VELS(tt) (tt)
+#endif
+
+/* with -DDIAGNOSE=N the flow is summarised every N timesteps without
+** gathering the lattice: MASTER appends a line of the timestep, the
+** minimum and maximum speed of the fluid cells, the total density and the
+** Reynolds number to DIAGFILE, and writes the grid coarsened to blocks of
+** DIAG_BLOCK x DIAG_BLOCK cells to DIAG_FIELD_FILE for the timestep, one
+** line per block like those of FINALSTATEFILE, with the mean velocity and
+** pressure of its fluid cells and their number. */
+#define DIAGFILE "diagnostics.dat"
+#define DIAG_FIELD_FILE "diag_%06d.dat"
+#define DIAG_FIELDS 4 /* sums of u_x, u_y, pressure and cells per block */
+
+/* with -DPROFILE the time spent in each phase of the run is measured on
+** every process, summarised on MASTER and written to PROFILEFILE */
+#define PROFILEFILE "profile.csv"
+#define STATE_FIELDS 5
+#define STATE_NAME_LEN 16
+#define ALIGNMENT 64 /* byte alignment of the speed planes */
+#define HUGE_PAGE (2 << 20) /* blocks this big are mapped in huge pages */
+/* relative costs of updating a fluid cell and an obstacle cell (rebound
+** only, or nothing away from the fluid), for -DBALANCE */
+#define FLUID_COST 4
+#define OBSTACLE_COST 1
 
 // #define DEBUG
 
+/* the precision of the lattice and the arithmetic on it, t_real, and of
+** the sums of velocity norms across the grid, t_accum: float for both by
+** default, double for both with -DDOUBLE, or float lattice and double
+** sums with -DMIXED */
+#if defined(DOUBLE) && defined(MIXED)
+#error "DOUBLE and MIXED are alternative precisions"
+#define BAD_FLAGS
+#endif
+
+#ifdef DOUBLE
+typedef double t_real;
+#define REAL_MPI MPI_DOUBLE
+#define REAL_SCAN "%lf"
+#else
+typedef float t_real;
+#define REAL_MPI MPI_FLOAT
+#define REAL_SCAN "%f"
+#endif
+
+#if defined(DOUBLE) || defined(MIXED)
+typedef double t_accum;
+#define ACCUM_MPI MPI_DOUBLE
+#else
+typedef float t_accum;
+#define ACCUM_MPI MPI_FLOAT
+#endif
+
 /* struct to hold the parameter values */
 typedef struct {
   int nx;           /* no. of cells in x-direction */
   int ny;           /* no. of cells in y-direction */
   int maxIters;     /* no. of iterations */
   int reynolds_dim; /* dimension for Reynolds number */
-  float density;    /* density per link */
-  float accel;      /* density redistribution */
-  float omega;      /* relaxation parameter */
+  t_real density;   /* density per link */
+  t_real accel;     /* density redistribution */
+  t_real omega;     /* relaxation parameter */
+  int fluid_cells;  /* no. of cells in the grid not blocked by obstacles */
 } t_param;
 
+/* struct to hold the part of the grid owned by this process. The local
+** grid has a ring of halo cells around the owned ones, so owned cells are
+** indexed from 1 in both directions and rows are width cells long. With
+** -DHALO_DEPTH there are HALO_ROWS halo rows above and below, the deeper
+** ones below at negative row indices. */
+typedef struct {
+  MPI_Comm comm;       /* Cartesian communicator over all the processes */
+  int rank;            /* rank of this process in comm */
+  int size;            /* no. of processes in comm */
+  int dims[2];         /* no. of processes in the y and x directions */
+  int coords[2];       /* coordinates of this process in y and x */
+  int north;           /* rank owning the rows above */
+  int south;           /* rank owning the rows below */
+  int east;            /* rank owning the columns to the right */
+  int west;            /* rank owning the columns to the left */
+  int x_start;         /* global index of the first owned column */
+  int y_start;         /* global index of the first owned row */
+  int nx;              /* no. of owned columns */
+  int ny;              /* no. of owned rows */
+  int width;           /* row length of the local grid, incl. halos */
+  int* row_starts;     /* first row of each row of processes, then ny */
+  MPI_Datatype north_rows;  /* owned rows sent to the north halo, */
+  MPI_Datatype south_rows;  /* ... the south halo, */
+  MPI_Datatype east_column; /* owned column sent to the east halo */
+  MPI_Datatype west_column; /* ... and the west halo */
+#ifdef AA_PATTERN
+  MPI_Datatype north_return; /* speeds pushed into the north halo, */
+  MPI_Datatype south_return; /* ... the south halo, */
+  MPI_Datatype east_return;  /* ... the east halo */
+  MPI_Datatype west_return;  /* ... and the west halo, sent back */
+#endif
+} t_domain;
+
+#if defined(OVERLAP) && defined(REFERENCE)
+#error "OVERLAP needs the fused timestep() kernel"
+#define BAD_FLAGS
+#endif
+
+/* with -DHALO_DEPTH=k there are k halo rows on each side, exchanged every
+** k timesteps, and each process recomputes the ones it can in between */
+#ifdef HALO_DEPTH
+#if HALO_DEPTH < 1
+#error "HALO_DEPTH must be at least 1"
+#define BAD_FLAGS
+#endif
+#if defined(REFERENCE) || defined(OVERLAP) || defined(DECOMP_2D)
+#error "HALO_DEPTH needs the fused timestep() kernel and rows only"
+#define BAD_FLAGS
+#endif
+#define HALO_ROWS HALO_DEPTH
+#else
+#define HALO_ROWS 1
+#endif
+
+/* with -DTHIN_HALO only the three speeds moving into a halo are sent */
+#if defined(THIN_HALO) && HALO_ROWS > 1
+#error "THIN_HALO needs every speed of the deeper halo rows"
+#define BAD_FLAGS
+#endif
+
+/* with -DOFFLOAD the lattice stays in device memory for the whole run and
+** the timesteps are OpenMP target regions; with -DDEVICE_MPI as well the
+** halos are sent straight from device memory, by an MPI that accepts
+** device pointers, instead of through the host copy of the grid */
+#ifdef OFFLOAD
+#ifndef SOA
+#error "OFFLOAD needs the SoA layout, for coalesced device memory accesses"
+#define BAD_FLAGS
+#endif
+#if defined(REFERENCE) || defined(OVERLAP) || defined(HALO_DEPTH) || \
+    defined(DECOMP_2D)
+#error "OFFLOAD needs the fused timestep() kernel and rows only"
+#define BAD_FLAGS
+#endif
+#endif
+
+/* with -DAA_PATTERN there is a single lattice, updated in place by the
+** AA pattern: timesteps alternate between pulling the densities from the
+** neighbours and pushing the results back out to them, in the speeds
+** opposite to the ones they move in, and reading and writing a cell's own
+** densities. The lattice is in the usual layout after an even number of
+** timesteps, otherwise swapped, see timestep_aa(). */
+#ifdef AA_PATTERN
+#if defined(REFERENCE) || defined(OVERLAP) || defined(HALO_DEPTH) || \
+    defined(OFFLOAD)
+#error "AA_PATTERN needs the fused kernel and a single halo row"
+#define BAD_FLAGS
+#endif
+#endif
+
+/* with -DFIXED_SIZES timestep_row() is also built for the row widths of
+** the production grids, 128, 256 and 1024 cells, as compile time
+** constants, and used instead of the generic one by the processes whose
+** rows are that wide, unless a SIMD kernel can be */
+#ifdef FIXED_SIZES
+#if defined(REFERENCE) || defined(OFFLOAD) || defined(AA_PATTERN)
+#error "FIXED_SIZES specialises the row kernels of timestep()"
+#define BAD_FLAGS
+#endif
+#endif
+
+/* with -DDIAGNOSE=N each process sums the blocks and finds the extremes
+** of its own cells, and only those are reduced onto MASTER. The lattice
+** is summarised as it is after the timestep, so it isn't accelerated for
+** the next one until that has been done. */
+#ifdef DIAGNOSE
+#if DIAGNOSE < 1
+#error "DIAGNOSE must be at least 1 timestep"
+#define BAD_FLAGS
+#endif
+#ifndef DIAG_BLOCK
+#define DIAG_BLOCK 8
+#endif
+#if DIAG_BLOCK < 1
+#error "DIAG_BLOCK must be at least 1 cell"
+#define BAD_FLAGS
+#endif
+#endif
+
+/* with -DSPARSE the timesteps store and update only the fluid cells of
+** each local grid, in grids of their own with a table of the cell each
+** speed is pulled from, see t_sparse, instead of the whole grid with its
+** obstacles. The dense grid is only rebuilt for checkpoints, -DDIAGNOSE
+** and the output. */
+#ifdef SPARSE
+#if defined(REFERENCE) || defined(OVERLAP) || defined(HALO_DEPTH) || \
+    defined(DECOMP_2D) || defined(OFFLOAD) || defined(AA_PATTERN) ||  \
+    defined(FIXED_SIZES)
+#error "SPARSE replaces the kernels of timestep() and needs rows only"
+#define BAD_FLAGS
+#endif
+#endif
+
+/* with -DREDUCE_EVERY=N the per-rank velocity sums are kept in av_vels
+** and reduced together every N timesteps (or only at the end if N is 0),
+** instead of with a collective every timestep */
+#if defined(REDUCE_EVERY) && defined(REFERENCE)
+#error "REDUCE_EVERY needs the fused timestep() kernel"
+#define BAD_FLAGS
+#endif
+
+/* with -DCONVERGE=tol the run stops early, before maxIters, once the
+** average velocity has varied by no more than tol relative to its value
+** over the last CONVERGE_WINDOW timesteps; the whole range is used, so
+** that a flow oscillating with a period near the window doesn't look
+** steady. The averages are reduced onto
+** every process instead of MASTER for it, so that they all see the same
+** values and stop at the same timestep without any more messages; with
+** -DREDUCE_EVERY this is only checked when they are reduced. */
+#ifdef CONVERGE
+#ifndef CONVERGE_WINDOW
+#define CONVERGE_WINDOW 1000
+#endif
+#if CONVERGE_WINDOW < 1
+#error "CONVERGE_WINDOW must be at least 1 timestep"
+#define BAD_FLAGS
+#endif
+#endif
+
+/* with -DCHECK_RESULTS the results are checked at the end of the run,
+** as check/check.c does, against the reference results for the grid in
+** CHECK_DIR, <nx>x<ny>.av_vels.dat and the binary <nx>x<ny>.final_state.bin
+** (made by make refs): the largest relative difference of the av_vels and
+** of the pressures of the final state must be within CHECK_TOLERANCE
+** percent. The final state is compared where it is, each process reading
+** its own tile of the reference, and the run fails if the check does. */
+#ifdef CHECK_RESULTS
+#ifndef CHECK_DIR
+#define CHECK_DIR "check"
+#endif
+#ifndef CHECK_TOLERANCE
+#define CHECK_TOLERANCE 1
+#endif
+#endif
+
+/* with -DSTREAM_AV_VELS=S MASTER writes the average velocity of every S-th
+** timestep (every one if S is left out) to AVVELSFILE as the run goes,
+** instead of keeping them all for the end. The lines are collected in
+** chunks of AV_VELS_CHUNK, and each full chunk is written asynchronously
+** while the next one fills. The other processes keep no av_vels, or only
+** the sums since the last reduction with -DREDUCE_EVERY. */
+#ifdef STREAM_AV_VELS
+#if STREAM_AV_VELS < 1
+#error "STREAM_AV_VELS must be a stride of at least 1"
+#define BAD_FLAGS
+#endif
+#define AV_VELS_CHUNK 4096
+#define AV_VELS_LINE 48 /* longest line of AVVELSFILE, with room to spare */
+#endif
+
+/* after any of the errors above the rest isn't compiled, so that they are
+** all that is reported and not what they lead to further on */
+#ifndef BAD_FLAGS
+
+#ifdef SOA
+/* struct to hold the 'speed' values as a structure of arrays:
+** one contiguous, aligned plane of values per speed */
+typedef struct {
+  t_real* speeds[NSPEEDS];
+} t_speed;
+
+/* access speed kk of the cell at (1D) index in a grid */
+#define SPEED(cells, index, kk) ((cells)->speeds[kk][index])
+#else
 /* struct to hold the 'speed' values */
 typedef struct {
-  float speeds[NSPEEDS];
+  t_real speeds[NSPEEDS];
 } t_speed;
 
+/* access speed kk of the cell at (1D) index in a grid */
+#define SPEED(cells, index, kk) ((cells)[index].speeds[kk])
+#endif
+
+/* struct to hold the obstacles in the local grid, incl. its halos, as a
+** bitmask with one bit per cell and each row padded to whole words. Only
+** fluid cells, and the obstacle cells next to them (whose bounced-back
+** densities flow into the fluid), need updating, so the spans of such
+** cells in each owned row (and in each halo row recomputed locally with
+** -DHALO_DEPTH) are listed too. */
+typedef struct {
+  uint32_t* bits; /* bit ii % 32 of word ii / 32 of a row set if blocked */
+  int row_words;  /* no. of words per row, incl. one of padding */
+  int* spans;     /* [start, end) columns of the spans of all the rows */
+  int* row_spans; /* the spans of row jj are row_spans[jj]..[jj + 1] - 1 */
+} t_obstacles;
+
+#ifdef SPARSE
+/* struct to hold the layout of the fluid cells of the local grid, halo
+** rows included, for -DSPARSE. Their grids from alloc_grid() hold these
+** cells only, row by row, so a halo row is one block of a grid. An owned
+** fluid cell pulls each speed from the fluid cell in neighbours, or if
+** that is an obstacle bounces back the density it sent the other way in
+** the last timestep, which is still in tmp_cells: the dense grid only
+** keeps it in the obstacle cell for the one timestep. */
+typedef struct {
+  int ncells;      /* no. of fluid cells in the local grid */
+  int owned_end;   /* the first cell of the halo row above the owned ones */
+  int* row_starts; /* the cells of row jj are row_starts[jj]..[jj + 1] - 1 */
+  int* neighbours; /* the cells each speed but 0 of an owned cell is pulled
+                   ** from, NSPEEDS - 1 per cell from row_starts[1] on, or
+                   ** -1 for an obstacle */
+  MPI_Datatype north_rows; /* owned row sent to the north halo, */
+  MPI_Datatype south_rows; /* ... the south halo, */
+  MPI_Datatype north_halo; /* halo row received from the north */
+  MPI_Datatype south_halo; /* ... and the south */
+} t_sparse;
+#endif
+
+/* an ensemble file lists the simulations to run, one per line: the param
+** file, the obstacle file and the directory to write the output into,
+** each at most NAME_LEN - 1 chars. Blank lines and lines starting with #
+** are skipped. */
+#define NAME_LEN 256
+
+/* struct to hold one simulation of an ensemble */
+typedef struct {
+  char paramfile[NAME_LEN];
+  char obstaclefile[NAME_LEN];
+  char outdir[NAME_LEN];
+} t_member;
+
+/* struct to hold the obstacle map last read on MASTER in an ensemble,
+** for the next simulation with the same obstacle file */
+typedef struct {
+  char obstaclefile[NAME_LEN]; /* the file it was read from, or "" */
+  int nx, ny;                  /* the grid size it was read for */
+  uint32_t* map;               /* bitmap as used by initialise(), or NULL */
+} t_map_cache;
+
+/* whether cell (ii, jj) of the local grid is blocked */
+#define BLOCKED(obs, ii, jj) \
+  (((obs)->bits[(jj) * (obs)->row_words + ((ii) >> 5)] >> ((ii)&31)) & 1u)
+
+/* the obstacle bits of the 32 cells from (ii, jj) along the row, from
+** the word holding (ii, jj) and the one after it */
+#define BLOCKED_BITS(obs, ii, jj)                                         \
+  ((uint32_t)(((uint64_t)(obs)->bits[(jj) * (obs)->row_words +            \
+                                     ((ii) >> 5) + 1]                     \
+                   << 32 |                                                \
+               (obs)->bits[(jj) * (obs)->row_words + ((ii) >> 5)]) >>     \
+              ((ii)&31)))
+
+#ifdef STREAM_AV_VELS
+/* struct to hold the state of the AVVELSFILE writer on MASTER */
+typedef struct {
+  int fd;           /* AVVELSFILE, or -1 on the other processes */
+  off_t offset;     /* where the next chunk goes in the file */
+  char* chunks[2];  /* the chunk filling and the one being written */
+  int filling;      /* index of the chunk filling */
+  int lines;        /* no. of lines in it so far */
+  size_t length;    /* and their length */
+  struct aiocb aio; /* the write of the other chunk */
+  int pending;      /* whether that write may not have finished */
+} t_av_stream;
+#endif
+
+#ifdef PROFILE
+/* phases of a run timed with -DPROFILE, see phase_names in main() */
+enum {
+  PHASE_ACCELERATE,
+  PHASE_HALO,
+  PHASE_PROPAGATE,
+  PHASE_COLLISION,
+  PHASE_TIMESTEP,
+  PHASE_REDUCE,
+  PHASE_CHECKPOINT,
+  PHASE_DIAGNOSE,
+  PHASE_SYNC,
+  PHASE_OUTPUT,
+  NPHASES
+};
+
+/* run the statements, adding the time they take to profile[phase] */
+#define TIMED(profile, phase, ...)              \
+  do {                                          \
+    const double phase_tic = MPI_Wtime();       \
+    __VA_ARGS__;                                \
+    (profile)[phase] += MPI_Wtime() - phase_tic; \
+  } while (0)
+#else
+#define TIMED(profile, phase, ...) __VA_ARGS__
+#endif
+
+/* signature of the kernels updating a single row of the grid, adding
+** the velocity norms of the fluid cells to tot_u */
+typedef int (*t_row_kernel)(const t_param params, const t_domain domain,
+                            t_speed* cells, t_speed* tmp_cells,
+                            const t_obstacles* obstacles, int jj,
+                            t_accum* tot_u);
+
 /*
 ** function prototypes
 */
 
+/* run one simulation on the processes of comm, from initialise() to
+** finalise(). The output files are written into outdir, created if need
+** be, or the current directory if outdir is NULL. If cache is not NULL
+** the obstacle map is taken from it when it holds the same one, and the
+** map read is kept in it otherwise. */
+int simulate(MPI_Comm comm, const char* paramfile, const char* obstaclefile,
+             const char* checkpointfile, const char* outdir,
+             t_map_cache* cache);
+
+/* run the simulations listed in ensemblefile, several at once: the
+** processes are split into as many groups of consecutive ranks as there
+** are simulations, or processes if fewer, and each group runs a block of
+** consecutive simulations one after the other */
+int run_ensemble(const char* ensemblefile);
+
+/* read the simulations listed in ensemblefile on MASTER into a new array
+** of count members */
+int read_ensemble(const char* ensemblefile, t_member** members_ptr,
+                  int* count);
+
 /* load params, allocate memory, load obstacles & initialise fluid particle
- * densities */
-int initialise(const char* paramfile, const char* obstaclefile, t_param* params,
-               t_speed** cells_ptr, t_speed** tmp_cells_ptr,
-               int** obstacles_ptr, float** av_vels_ptr);
+** densities, for the processes in comm. Each rank only allocates the part
+** of the grid it owns plus a ring of halo cells, see t_domain; MASTER also
+** keeps the whole obstacle map in global_obstacles for output. If
+** checkpointfile is not NULL the densities and av_vels are restored from
+** it, and tt_start set to the timestep to carry on from. The obstacle
+** map is shared through cache as in simulate(). */
+int initialise(MPI_Comm comm, const char* paramfile, const char* obstaclefile,
+               const char* checkpointfile, t_map_cache* cache,
+               t_param* params, t_domain* domain, t_speed** cells_ptr,
+               t_speed** tmp_cells_ptr, t_obstacles** obstacles_ptr,
+               int** global_obstacles_ptr, t_accum** av_vels_ptr,
+               int* tt_start);
+
+/* split the grid over the processes of comm in a Cartesian communicator,
+** one dimensional (rows only) unless built with -DDECOMP_2D. If row_costs
+** is not NULL the rows are split so each row of processes has about the
+** same total cost, otherwise into equal numbers of rows */
+int decompose(MPI_Comm comm, const t_param params, const int* row_costs,
+              t_domain* domain);
+
+/* calculate the first row and number of rows of the grid owned by a rank */
+int domain_range(int rows, int rank, int ranks, int* domain_start,
+                 int* domain_size);
+
+/* split rows with the given costs into ranks contiguous blocks of about
+** equal total cost, at least one row each; block r starts at starts[r] and
+** starts[ranks] is set to rows */
+int balance_range(const int* costs, int rows, int ranks, int* starts);
+
+/* the cost of updating each row of the grid, from the obstacle map on
+** MASTER, broadcast to every process of comm */
+int row_costs(MPI_Comm comm, const t_param params, const uint32_t* map,
+              int* costs);
+
+/* read the parameter file on MASTER and broadcast the values over comm */
+int read_params(MPI_Comm comm, const char* paramfile, t_param* params);
+
+/* read the obstacle file, text or binary, into the bitmap map of the whole
+** grid on MASTER, laid out as in the binary file */
+int read_obstacles(const t_param params, const char* obstaclefile,
+                   uint32_t* map);
+
+/* send each process the rows of map on MASTER covering its local grid,
+** halos included: ny + 2 * HALO_ROWS rows from row y_start - HALO_ROWS,
+** wrapped around the grid, into rows */
+int scatter_obstacles(const t_param params, const t_domain domain,
+                      const uint32_t* map, uint32_t* rows);
 
 /*
 ** The main calculation methods.
-** timestep calls, in order, the functions:
+** timestep() fuses propagate(), rebound() & collision() into a single
+** sweep, pulling from cells and writing into tmp_cells and adding the
+** velocity norms of the updated rows to tot_u. If accel_row is one of the
+** updated rows, accelerate_flow() is applied to it for the next timestep
+** straight after, while it is still in cache. Building with
+** -DREFERENCE instead calls, in order, the functions:
 ** accelerate_flow(), propagate(), rebound() & collision()
 */
-int accelerate_flow(const t_param params, t_speed* cells, int* obstacles);
-int propagate(int ii, int jj, const t_param params, t_speed* cells,
-              t_speed* tmp_cells);
-int rebound(int ii, int jj, const t_param params, t_speed* cells,
-            t_speed* tmp_cells, int* obstacles);
-int collision(int ii, int jj, const t_param params, t_speed* cells,
-              t_speed* tmp_cells, int* obstacles);
-int halo_exchange(t_speed* cells, float* sendbuf, float* recvbuf, int width,
-                  int height, int domain_start, int domain_size, int rank,
-                  int size);
+int accelerate_flow(const t_param params, const t_domain domain,
+                    t_speed* cells, const t_obstacles* obstacles, int jj);
+int timestep(const t_param params, const t_domain domain, t_speed* cells,
+             t_speed* tmp_cells, const t_obstacles* obstacles, int row_start,
+             int row_end, int accel_row, t_row_kernel row_kernel,
+             t_accum* tot_u);
+int timestep_cells(const t_param params, const t_domain domain,
+                   t_speed* cells, t_speed* tmp_cells,
+                   const t_obstacles* obstacles, int jj, int ii_start,
+                   int ii_end, t_accum* tot_u);
+
+/* run steps (at most HALO_DEPTH) timesteps after an exchange of HALO_ROWS
+** halo rows, each updating one row fewer at each end than the last, down
+** to the owned rows. The steps alternate between cells and tmp_cells, so
+** the result is in tmp_cells if steps is odd. They sweep the rows as one
+** wavefront, each step two rows behind the one before, so every step of
+** a row is done while it is still in cache. tot_u[s] is set to the
+** velocity norms of the owned rows at step s. The accelerated row is
+** accelerated between the steps, and after the last if accelerate_last
+** is set. */
+int timestep_block(const t_param params, const t_domain domain,
+                   t_speed* cells, t_speed* tmp_cells,
+                   const t_obstacles* obstacles, int steps,
+                   int accelerate_last, t_row_kernel row_kernel,
+                   t_accum* tot_u);
+int timestep_row(const t_param params, const t_domain domain, t_speed* cells,
+                 t_speed* tmp_cells, const t_obstacles* obstacles, int jj,
+                 t_accum* tot_u);
+#ifdef SIMD_KERNELS
+int timestep_row_avx2(const t_param params, const t_domain domain,
+                      t_speed* cells, t_speed* tmp_cells,
+                      const t_obstacles* obstacles, int jj, t_accum* tot_u);
+int timestep_row_avx512(const t_param params, const t_domain domain,
+                        t_speed* cells, t_speed* tmp_cells,
+                        const t_obstacles* obstacles, int jj, t_accum* tot_u);
+#endif
+
+#ifdef FIXED_SIZES
+/* timestep_row() for rows of nx owned cells, wrapped in their halo
+** cells, with the width of the grid a constant once it is inlined */
+#define FIXED_ROW_KERNEL(nx)                                                \
+  FLATTEN int timestep_row_##nx(const t_param params, const t_domain domain, \
+                                t_speed* cells, t_speed* tmp_cells,          \
+                                const t_obstacles* obstacles, int jj,        \
+                                t_accum* tot_u)
+FIXED_ROW_KERNEL(128);
+FIXED_ROW_KERNEL(256);
+FIXED_ROW_KERNEL(1024);
+#endif
+
+/* pick the fastest row kernel the CPU we are running on supports, for the
+** rows of domain */
+t_row_kernel select_row_kernel(const t_domain domain);
+
+#ifdef AA_PATTERN
+/* one timestep of the AA pattern on the single lattice cells, in place
+** of timestep(), accelerating row accel_row as it goes. Unless swapped,
+** cells is in the usual layout: after a halo_exchange() the densities are
+** pulled from the neighbours as usual, collided and pushed back out, each
+** into the opposite speed of the cell it moves to, halos included, for
+** halo_return() to pass on. That leaves cells swapped, and the next
+** timestep reads each cell's own densities from the opposite speeds and
+** writes the results back into its usual ones, without any halo
+** exchange. */
+int timestep_aa(const t_param params, const t_domain domain, t_speed* cells,
+                const t_obstacles* obstacles, int swapped, int accel_row,
+                t_accum* tot_u);
+int timestep_aa_cells(const t_param params, const t_domain domain,
+                      t_speed* cells, const t_obstacles* obstacles,
+                      int swapped, int jj, int ii_start, int ii_end,
+                      int accelerate, t_accum* tot_u);
+
+/* put a swapped lattice back into the usual layout, in place, for the
+** output and checkpoints; straight after the push timestep, whose halos
+** still hold the densities pushed into them */
+int unswap_aa(const t_domain domain, t_speed* cells);
+#endif
+
+#ifdef OFFLOAD
+/* timestep() and accelerate_flow() for grids and obstacles in device
+** memory, from device_grid() and device_obstacles(). The teams of the
+** device take the owned rows and their threads the cells of a row. */
+int timestep_device(const t_param params, const t_domain domain,
+                    t_speed* cells, t_speed* tmp_cells,
+                    const t_obstacles* obstacles, int accel_row,
+                    t_accum* tot_u);
+int accelerate_device(const t_param params, const t_domain domain,
+                      t_speed* cells, const t_obstacles* obstacles, int jj);
+
+/* halo_exchange() for a grid in device memory, whose host copy is
+** host_cells. The halo columns are filled in on the device, as the
+** processes own whole rows. */
+int halo_exchange_device(const t_domain domain, t_speed* host_cells,
+                         t_speed* cells);
+#endif
+int propagate(int ii, int jj, const t_param params, const t_domain domain,
+              t_speed* cells, t_speed* tmp_cells);
+int rebound(int ii, int jj, const t_param params, const t_domain domain,
+            t_speed* cells, t_speed* tmp_cells,
+            const t_obstacles* obstacles);
+int collision(int ii, int jj, const t_param params, const t_domain domain,
+              t_speed* cells, t_speed* tmp_cells,
+              const t_obstacles* obstacles);
+
+/* fill the ring of halo cells from the neighbouring processes: the halo
+** columns first, then whole rows including the corners of the ring, which
+** carry the diagonal speeds. Everything is sent straight out of and into
+** the grid with the datatypes in domain, HALO_ROWS rows at a time. */
+int halo_exchange(const t_domain domain, t_speed* cells);
+int halo_exchange_columns(const t_domain domain, t_speed* cells);
+int halo_exchange_rows(const t_domain domain, t_speed* cells);
+
+#ifdef AA_PATTERN
+/* the reverse of halo_exchange() for the push timestep of the AA pattern:
+** the speeds pushed into the halos are sent back to the owned cells they
+** belong to, the rows first, corners included, then the columns */
+int halo_return(const t_domain domain, t_speed* cells);
+#endif
+
+#ifdef SPARSE
+/* lay out the fluid cells of the local grid, see t_sparse, and replace
+** the dense grids in cells_ptr and tmp_cells_ptr with ones of those cells
+** only, freeing them; the densities in the obstacle cells next to the
+** fluid go into tmp_cells, where timestep_sparse() bounces them back */
+int init_sparse(const t_domain domain, const t_obstacles* obstacles,
+                t_sparse* sparse, t_speed** cells_ptr,
+                t_speed** tmp_cells_ptr);
+void free_sparse(t_sparse* sparse);
+
+/* index of each cell of the local grid in the sparse grids, or -1 for an
+** obstacle, at ii + jj * width; the cells of the halo columns are the
+** owned ones they wrap around to */
+int* sparse_map(const t_domain domain, const t_obstacles* obstacles,
+                const t_sparse* sparse);
+
+/* a new dense local grid from the sparse grids, with the obstacle cells
+** holding what they would in the dense timesteps; the halos are left
+** out */
+t_speed* dense_grid(const t_param params, const t_domain domain,
+                    const t_obstacles* obstacles,
+                    const t_sparse* sparse, t_speed* cells,
+                    t_speed* tmp_cells);
+
+/* timestep(), accelerate_flow() and halo_exchange() for the sparse grids,
+** all the owned cells at once */
+int timestep_sparse(const t_param params, const t_sparse* sparse,
+                    t_speed* cells, t_speed* tmp_cells, int accel_row,
+                    t_accum* tot_u);
+int accelerate_sparse(const t_param params, const t_sparse* sparse,
+                      t_speed* cells, int jj);
+int halo_exchange_sparse(const t_domain domain, const t_sparse* sparse,
+                         t_speed* cells);
+#endif
+
+/* non-blocking halo exchange: begin exchanges the columns, then posts the
+** messages for the halo rows; end waits for them */
+int halo_exchange_begin(const t_domain domain, t_speed* cells,
+                        MPI_Request* requests);
+int halo_exchange_end(const t_domain domain, MPI_Request* requests);
+
+/* create the halo datatypes in domain, for grids laid out like cells */
+int halo_types(t_speed* cells, t_domain* domain);
+
+/* fill in the periodic halo columns of row jj, for a process owning
+** whole rows */
+void wrap_row(const t_domain domain, t_speed* cells, int jj);
 int write_values(const t_param params, t_speed* cells, int* obstacles,
-                 float* av_vels);
+                 t_accum* av_vels);
+int write_av_vels(const t_param params, t_accum* av_vels);
+
+#ifdef STREAM_AV_VELS
+/* open AVVELSFILE on MASTER for the timesteps from tt_start on, keeping
+** the lines of the earlier ones after a restart */
+int open_av_stream(const t_domain domain, int tt_start, t_av_stream* stream);
+
+/* add the average velocities of the count timesteps from tt to the file,
+** the sampled ones at least; a no-op off MASTER */
+int stream_av_vels(t_av_stream* stream, int tt, const t_accum* av_vels,
+                   int count);
+
+/* start writing the chunk filling, once the last write has finished, and
+** with wait set wait for it to finish as well; wait_av_stream() only
+** waits for the last write */
+int flush_av_stream(t_av_stream* stream, int wait);
+int wait_av_stream(t_av_stream* stream);
+
+/* write out what's left and close the file */
+int close_av_stream(t_av_stream* stream);
+#endif
 
-int sync_grid(t_speed* cells, int rank, int domain_start, int domain_size,
-              int rows, int columns, int ranks);
+/* compute the u_x, u_y, u and pressure written out for a cell */
+int cell_state(const t_param params, t_speed* cells, int index, int blocked,
+               t_real* state);
+
+/* write the final state of the cells owned by each process into the
+** binary FINALSTATEBINFILE, collectively */
+int write_state(const t_param params, const t_domain domain, t_speed* cells,
+                const t_obstacles* obstacles);
+
+/* the part of a file of count values of type per cell of the whole grid,
+** in row major order, holding the cells owned by this process */
+int file_tile(const t_param params, const t_domain domain, int count,
+              MPI_Datatype type, MPI_Datatype* tile);
+
+/* save the state before timestep tt into CHECKPOINTFILE, or load it from
+** checkpointfile, collectively; av_vels is only used on MASTER */
+int write_checkpoint(const t_param params, const t_domain domain,
+                     t_speed* cells, t_accum* av_vels, int tt);
+int read_checkpoint(const char* checkpointfile, const t_param params,
+                    const t_domain domain, t_speed* cells, t_accum* av_vels,
+                    int* tt);
+
+/* gather the cells owned by each rank into global_cells on MASTER */
+int sync_grid(const t_param params, const t_domain domain, t_speed* cells,
+              t_speed* global_cells);
+
+/* the datatype for a block of nx by ny cells, cell by cell, of a grid laid
+** out like cells with rows width cells long. Only the nspeeds speeds
+** listed in speeds are included, or every one if speeds is NULL */
+int block_type(const t_speed* cells, int nx, int ny, int width,
+               const int* speeds, int nspeeds, MPI_Datatype* type);
+
+/* allocate and free a grid of ncells cells in the configured layout,
+** indexed from -offset so the deeper halo rows can be below row 0 */
+t_speed* alloc_grid(int ncells, int offset);
+void free_grid(t_speed* cells, int offset);
+
+/* allocate size bytes for the grids and obstacles, ALIGNMENT aligned, or
+** return NULL. On Linux blocks of a HUGE_PAGE or more are mapped in
+** explicit huge pages if any are reserved, or else transparent ones, and
+** their pages are placed on the NUMA node of the thread first touching
+** them, whatever the memory policy of the process. */
+void* alloc_lattice(size_t size);
+void free_lattice(void* block);
+
+#ifdef OFFLOAD
+/* copy a grid from alloc_grid() to the device, returning the same grid in
+** device memory, and copy it back into cells if copy is set as it is
+** freed. update_host_grid() copies it back without freeing it. */
+t_speed* device_grid(t_speed* cells);
+void free_device_grid(t_speed* dev_cells, t_speed* cells, int copy);
+int update_host_grid(t_speed* cells);
+
+/* copy the obstacle bits of a local grid of rows rows to the device; the
+** spans are left out, as the device updates every cell */
+t_obstacles* device_obstacles(const t_obstacles* obstacles, int rows);
+void free_device_obstacles(t_obstacles* dev_obstacles,
+                           const t_obstacles* obstacles, int rows);
+#endif
 
 /* finalise, including freeing up allocated memory */
-int finalise(const t_param* params, t_speed** cells_ptr,
-             t_speed** tmp_cells_ptr, int** obstacles_ptr, float** av_vels_ptr);
+int finalise(const t_param* params, t_domain* domain, t_speed** cells_ptr,
+             t_speed** tmp_cells_ptr, t_obstacles** obstacles_ptr,
+             t_speed** global_cells_ptr, int** global_obstacles_ptr,
+             t_accum** av_vels_ptr);
 
-/* Sum all the densities in the grid.
+/* Sum all the densities in the cells owned by this process.
 ** The total should remain constant from one timestep to the next. */
-float total_density(const t_param params, t_speed* cells);
+t_accum total_density(const t_param params, const t_domain domain,
+                      t_speed* cells);
+
+/* compute average velocity over all processes */
+t_accum av_velocity(const t_param params, const t_domain domain,
+                    t_speed* cells, const t_obstacles* obstacles);
+
+/* combine the per-rank velocity sums into the average velocity on MASTER,
+** or on every process with -DCONVERGE */
+t_accum reduce_av_velocity(const t_param params, const t_domain domain,
+                           t_accum tot_u);
+
+/* turn the per-rank velocity sums of count timesteps into the average
+** velocities on MASTER, or on every process with -DCONVERGE, in place */
+int reduce_av_vels(const t_param params, const t_domain domain,
+                   t_accum* av_vels, int count);
+
+#ifdef CONVERGE
+/* add the average velocities of the count timesteps from tt to recent,
+** the last CONVERGE_WINDOW of them by timestep, and return whether they
+** all lie within CONVERGE of the last one, relative to it. The window
+** must lie within the run, from tt_start on. */
+int converged(t_accum* recent, int tt_start, int tt, const t_accum* av_vels,
+              int count);
+#endif
+
+/* calculate Reynolds number, collectively over all processes */
+t_accum calc_reynolds(const t_param params, const t_domain domain,
+                      t_speed* cells, const t_obstacles* obstacles);
+
+/* list the spans of cells in each row which need updating: the owned
+** rows, and with -DHALO_DEPTH all but the outermost halo rows */
+int find_spans(const t_domain domain, t_obstacles* obstacles);
+
+#ifdef PROFILE
+/* print the min, mean and max time of each phase over the processes on
+** MASTER, and write the times of every process to PROFILEFILE */
+int report_profile(const t_domain domain, const double* profile,
+                   const char* const* phase_names, int steps);
+#endif
 
-/* compute average velocity */
-float av_velocity(const t_param params, t_speed* cells, int* obstacles,
-                  int rank, int domain_start, int domain_size, int sync);
+#ifdef CHECK_RESULTS
+/* check the final state in cells and the av_vels written to AVVELSFILE
+** against the reference results in refdir, collectively, printing the
+** largest differences on MASTER. Returns EXIT_FAILURE on every process if
+** either is beyond CHECK_TOLERANCE; a grid without reference results is
+** only reported. */
+int check_results(const t_param params, const t_domain domain,
+                  t_speed* cells, const t_obstacles* obstacles,
+                  const char* refdir);
+
+/* read up to capacity av_vels from a file like AVVELSFILE into values,
+** returning how many lines it has, or -1 if it can't be opened */
+int read_av_vels(const char* filename, int capacity, double* values);
+#endif
 
-/* calculate Reynolds number */
-float calc_reynolds(const t_param params, t_speed* cells, int* obstacles,
-                    int height);
+#ifdef DIAGNOSE
+/* summarise the lattice after timestep tt, collectively, and write the
+** statistics and the coarse field out on MASTER, see DIAGFILE */
+int write_diagnostics(const t_param params, const t_domain domain,
+                      t_speed* cells, const t_obstacles* obstacles, int tt);
+#endif
 
 /* utility functions */
 void die(const char* message, const int line, const char* file);
 void usage(const char* exe);
 
+#ifdef OFFLOAD
+/* the kernels called from the target regions */
+#pragma omp declare target(accelerate_flow, timestep_cells, wrap_row)
+#endif
+
 /*
 ** main program:
-** initialise, timestep loop, finalise
+** one simulation, or an ensemble of them
 */
 int main(int argc, char* argv[]) {
   char* paramfile = NULL;    /* name of the input parameter file */
   char* obstaclefile = NULL; /* name of a the input obstacle file */
-  t_param params;            /* struct to hold parameter values */
-  t_speed* cells = NULL;     /* grid containing fluid densities */
-  t_speed* tmp_cells = NULL; /* scratch space */
-  int* obstacles = NULL;     /* grid indicating which cells are blocked */
-  float* av_vels =
-      NULL; /* a record of the av. velocity computed for each timestep */
-  struct timeval timstr; /* structure to hold elapsed time */
-  struct rusage ru;      /* structure to hold CPU time--system and user */
-  double tic,
-      toc; /* floating point numbers to calculate elapsed wallclock time */
-  double usrtim; /* floating point number to record elapsed user CPU time */
-  double systim; /* floating point number to record elapsed system CPU time */
-  int rank;      /* 'rank' of process among it's cohort */
-  int size;      /* size of cohort, i.e. num processes started */
-  int domain_start; /* the starting y index of this process's domain */
-  int domain_size;  /* the length of this process's domain */
+  char* checkpointfile = NULL; /* name of a checkpoint to restart from */
+  char* ensemblefile = NULL;   /* name of a list of simulations to run */
   int flag;         /* for checking whether MPI_Init() has been called */
+  int provided;     /* level of thread support given by the MPI library */
+  int status;       /* exit status */
   enum bool { FALSE, TRUE }; /* enumerated type: false = 0, true = 1 */
-  float* sendbuf;            /* buffer to hold values to send */
-  float* recvbuf;            /* buffer to hold received values */
 
   /* parse the command line */
-  if (argc != 3) {
+  if (argc == 2) {
+    ensemblefile = argv[1];
+  } else if (argc != 3 && argc != 4) {
     usage(argv[0]);
   } else {
     paramfile = argv[1];
     obstaclefile = argv[2];
+    if (argc == 4) checkpointfile = argv[3];
   }
 
-  MPI_Init(&argc, &argv);
+  /* with OpenMP, only the main thread makes MPI calls, outside of the
+  ** parallel regions */
+  MPI_Init_thread(&argc, &argv, MPI_THREAD_FUNNELED, &provided);
   MPI_Initialized(&flag);
-  if (flag != TRUE) {
+  if (flag != TRUE || provided < MPI_THREAD_FUNNELED) {
     MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
   }
 
-  /*
-  ** determine the SIZE of the group of processes associated with
-  ** the 'communicator'.  MPI_COMM_WORLD is the default communicator
-  ** consisting of all the processes in the launched MPI 'job'
-  */
-  MPI_Comm_size(MPI_COMM_WORLD, &size);
+  /* MPI_COMM_WORLD is the default communicator consisting of all the
+  ** processes in the launched MPI 'job', which run a single simulation
+  ** unless given an ensemble */
+  if (ensemblefile != NULL) {
+    status = run_ensemble(ensemblefile);
+  } else {
+    status = simulate(MPI_COMM_WORLD, paramfile, obstaclefile,
+                      checkpointfile, NULL, NULL);
+  }
 
-  /* determine the RANK of the current process [0:SIZE-1] */
-  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  /* finialise the MPI enviroment */
+  MPI_Finalize();
+
+  return status;
+}
+
+int simulate(MPI_Comm comm, const char* paramfile, const char* obstaclefile,
+             const char* checkpointfile, const char* outdir,
+             t_map_cache* cache) {
+  t_param params;            /* struct to hold parameter values */
+  t_domain domain;           /* struct describing this process's cells */
+  t_speed* cells = NULL;     /* grid containing fluid densities */
+  t_speed* tmp_cells = NULL; /* scratch space */
+  t_obstacles* obstacles = NULL; /* which cells of the grid are blocked */
+  t_speed* global_cells = NULL; /* whole grid, gathered on MASTER */
+  int* global_obstacles = NULL; /* whole obstacle map, kept on MASTER */
+  t_accum* av_vels =
+      NULL; /* a record of the av. velocity computed for each timestep */
+  struct timeval timstr; /* structure to hold elapsed time */
+  struct rusage ru;      /* structure to hold CPU time--system and user */
+  double tic,
+      toc; /* floating point numbers to calculate elapsed wallclock time */
+  double usrtim; /* floating point number to record elapsed user CPU time */
+  double systim; /* floating point number to record elapsed system CPU time */
+  int rank;      /* 'rank' of process among those running the simulation */
+  int tt_start;  /* first timestep to run, later than 0 on a restart */
+  char cwd[4096]; /* directory to go back to from outdir */
+  int status = EXIT_SUCCESS; /* of the run, failed by -DCHECK_RESULTS */
+#if !defined(REFERENCE) && !defined(OFFLOAD) && !defined(AA_PATTERN) && \
+    !defined(SPARSE)
+  t_row_kernel row_kernel; /* kernel used to update each row */
+#endif
+#ifdef SPARSE
+  t_sparse sparse; /* layout of cells and tmp_cells until the output */
+#endif
+#ifdef OVERLAP
+  MPI_Request requests[4]; /* outstanding halo messages */
+#endif
+#ifdef STREAM_AV_VELS
+  t_av_stream stream; /* writer of AVVELSFILE, on MASTER */
+#endif
+#ifdef CONVERGE
+  t_accum recent[CONVERGE_WINDOW]; /* the last av. velocities, by tt */
+#endif
+#ifdef PROFILE
+  double profile[NPHASES] = {0.0}; /* time spent in each phase */
+  const char* const phase_names[NPHASES] = {
+      "accelerate", "halo",       "propagate", "collision",
+      "timestep",   "reduce",     "checkpoint", "diagnose",
+      "sync",       "output"};
+#endif
+
+  /* determine the RANK of the current process [0:SIZE-1] in comm */
+  MPI_Comm_rank(comm, &rank);
 
   /* initialise our data structures and load values from file */
-  initialise(paramfile, obstaclefile, &params, &cells, &tmp_cells, &obstacles,
-             &av_vels);
+  initialise(comm, paramfile, obstaclefile, checkpointfile, cache, &params,
+             &domain, &cells, &tmp_cells, &obstacles, &global_obstacles,
+             &av_vels, &tt_start);
 
-  /* calculate the size of the domain for this process */
-  domain_start = 0;
-  domain_size = 0;
+  /* the directory the inputs and reference results are relative to */
+  if (getcwd(cwd, sizeof(cwd)) == NULL)
+    die("cannot get the current directory", __LINE__, __FILE__);
 
-  for (int i = 0; i < params.ny; ++i) {
-    if (i % size == rank) {
-      domain_size++;
-    }
-    if (i % size < rank) {
-      domain_start++;
-    }
+  /* every output file goes into outdir, once the input files are read */
+  if (outdir != NULL) {
+    if (rank == MASTER && mkdir(outdir, 0777) != 0 && errno != EEXIST)
+      die("could not create output directory", __LINE__, __FILE__);
+
+    MPI_Barrier(comm);
+
+    if (chdir(outdir) != 0)
+      die("could not change to output directory", __LINE__, __FILE__);
   }
 
-  sendbuf = malloc(sizeof(float) * NSPEEDS * params.nx);
-  recvbuf = malloc(sizeof(float) * NSPEEDS * params.nx);
+#if !defined(REFERENCE) && !defined(OFFLOAD) && !defined(AA_PATTERN) && \
+    !defined(SPARSE)
+  row_kernel = select_row_kernel(domain);
+#endif
+
+#ifdef STREAM_AV_VELS
+  open_av_stream(domain, tt_start, &stream);
+#endif
+
+#ifdef OFFLOAD
+  /* the lattice stays on the device until the output: in the timestep
+  ** loop cells, tmp_cells and obstacles are the device copies, and the
+  ** host copies are kept alongside to bring them back into */
+  t_speed* host_cells = cells;
+  t_speed* host_tmp_cells = tmp_cells;
+  t_obstacles* host_obstacles = obstacles;
+
+  cells = device_grid(host_cells);
+  tmp_cells = device_grid(host_tmp_cells);
+  obstacles = device_obstacles(host_obstacles, domain.ny + 2);
+#endif
+
+#ifdef SPARSE
+  /* in the timestep loop cells and tmp_cells only hold the fluid cells */
+  init_sparse(domain, obstacles, &sparse, &cells, &tmp_cells);
+#endif
 
   /* iterate for maxIters timesteps */
   gettimeofday(&timstr, NULL);
   tic = timstr.tv_sec + (timstr.tv_usec / 1000000.0);
 
-  for (int tt = 0; tt < params.maxIters; tt++) {
-    if (rank == size - 1) {
-      accelerate_flow(params, cells, obstacles);
+#ifdef REDUCE_EVERY
+  int reduced = tt_start; /* the first timestep not yet reduced */
+#endif
+#ifdef HALO_DEPTH
+  t_accum block_u[HALO_DEPTH]; /* velocity norms of each step of a block */
+  int block_start = tt_start;  /* first timestep of the current block */
+  int block_end = tt_start;    /* first timestep after it */
+  int accelerate_last = 0;     /* whether the block accelerated its result */
+#endif
+
+  /* local index of the accelerated row, the 2nd from the top of the
+  ** grid, on the processes owning it, or -1 */
+  const int accel_row = params.ny - 2 >= domain.y_start &&
+                                params.ny - 2 < domain.y_start + domain.ny
+                            ? params.ny - 2 - domain.y_start + 1
+                            : -1;
+  /* whether cells has already been accelerated for this timestep, by the
+  ** kernel at the end of the last one; never with -DREFERENCE. Within a
+  ** block of -DHALO_DEPTH timesteps, timestep_block() sees to it. */
+  int accelerated = 0;
+#ifdef AA_PATTERN
+  int swapped = 0; /* whether the lattice is in the swapped layout */
+#endif
+
+  for (int tt = tt_start; tt < params.maxIters; tt++) {
+#ifndef REDUCE_EVERY
+    t_accum av_vel; /* average velocity of this timestep, on MASTER */
+#endif
+#ifdef CONVERGE
+    int steady = 0; /* whether the flow has stopped changing */
+#endif
+#ifdef CHECKPOINT
+    /* whether to save the lattice after this timestep */
+    const int checkpoint =
+        (tt + 1) % CHECKPOINT == 0 && tt + 1 < params.maxIters;
+#endif
+#ifdef DIAGNOSE
+    /* whether to summarise the lattice after this timestep */
+    const int diagnose = (tt + 1) % DIAGNOSE == 0;
+#endif
+
+    /* accelerate the 2nd row from the top of the grid, on the
+    ** processes owning it */
+    if (accel_row > 0 && !accelerated) {
+#ifdef OFFLOAD
+      TIMED(profile, PHASE_ACCELERATE,
+            accelerate_device(params, domain, cells, obstacles, accel_row));
+#elif defined(SPARSE)
+      TIMED(profile, PHASE_ACCELERATE,
+            accelerate_sparse(params, &sparse, cells, accel_row));
+#else
+      TIMED(profile, PHASE_ACCELERATE,
+            accelerate_flow(params, domain, cells, obstacles, accel_row));
+#endif
+    }
+
+#ifdef REFERENCE
+    TIMED(profile, PHASE_HALO,
+          halo_exchange(domain, cells));
+
+    TIMED(profile, PHASE_PROPAGATE,
+          for (int jj = 1; jj <= domain.ny; ++jj) {
+            for (int ii = 1; ii <= domain.nx; ++ii) {
+              propagate(ii, jj, params, domain, cells, tmp_cells);
+              rebound(ii, jj, params, domain, cells, tmp_cells, obstacles);
+            }
+          });
+    TIMED(profile, PHASE_COLLISION,
+          for (int jj = 1; jj <= domain.ny; ++jj) {
+            for (int ii = 1; ii <= domain.nx; ++ii) {
+              collision(ii, jj, params, domain, cells, tmp_cells, obstacles);
+            }
+          });
+    TIMED(profile, PHASE_REDUCE,
+          av_vel = av_velocity(params, domain, cells, obstacles));
+#else
+#ifdef HALO_DEPTH
+    /* exchange HALO_DEPTH halo rows and run that many timesteps, or
+    ** fewer to end at the last timestep, a checkpoint or a summary */
+    if (tt == block_end) {
+      int steps = params.maxIters - tt;
+
+      if (steps > HALO_DEPTH) steps = HALO_DEPTH;
+#ifdef CHECKPOINT
+      if (steps > CHECKPOINT - tt % CHECKPOINT)
+        steps = CHECKPOINT - tt % CHECKPOINT;
+#endif
+#ifdef DIAGNOSE
+      if (steps > DIAGNOSE - tt % DIAGNOSE) steps = DIAGNOSE - tt % DIAGNOSE;
+#endif
+
+      /* the lattice is written out after the last timestep and at a
+      ** checkpoint, so it mustn't be accelerated for the next one yet */
+      accelerate_last = tt + steps < params.maxIters;
+#ifdef CHECKPOINT
+      if ((tt + steps) % CHECKPOINT == 0) accelerate_last = 0;
+#endif
+#ifdef DIAGNOSE
+      if ((tt + steps) % DIAGNOSE == 0) accelerate_last = 0;
+#endif
+
+      TIMED(profile, PHASE_HALO,
+            halo_exchange(domain, cells));
+      TIMED(profile, PHASE_TIMESTEP,
+            timestep_block(params, domain, cells, tmp_cells, obstacles, steps,
+                           accelerate_last, row_kernel, block_u));
+
+      /* the last step of the block wrote into tmp_cells */
+      if (steps % 2) {
+        t_speed* swap = cells;
+        cells = tmp_cells;
+        tmp_cells = swap;
+      }
+
+      block_start = tt;
+      block_end = tt + steps;
+    }
+
+    const t_accum tot_u = block_u[tt - block_start];
+
+    accelerated = tt + 1 < block_end || accelerate_last;
+#else
+    t_accum tot_u = 0; /* accumulated velocity norms of this rank's cells */
+
+    /* the kernel accelerates the new lattice for the next timestep as it
+    ** goes, unless the lattice is written out after this one */
+    int accelerate_next = tt + 1 < params.maxIters;
+#ifdef CHECKPOINT
+    if (checkpoint) accelerate_next = 0;
+#endif
+#ifdef DIAGNOSE
+    if (diagnose) accelerate_next = 0;
+#endif
+    const int next_row = accelerate_next ? accel_row : -1;
+
+#ifdef OVERLAP
+    /* update the rows which don't depend on the halos while the halo
+    ** messages are in flight, then finish the two boundary rows */
+    TIMED(profile, PHASE_HALO,
+          halo_exchange_begin(domain, cells, requests));
+    TIMED(profile, PHASE_TIMESTEP,
+          timestep(params, domain, cells, tmp_cells, obstacles, 2, domain.ny,
+                   next_row, row_kernel, &tot_u));
+    TIMED(profile, PHASE_HALO,
+          halo_exchange_end(domain, requests));
+    TIMED(profile, PHASE_TIMESTEP,
+          timestep(params, domain, cells, tmp_cells, obstacles, 1, 2,
+                   next_row, row_kernel, &tot_u);
+          if (domain.ny > 1) {
+            timestep(params, domain, cells, tmp_cells, obstacles, domain.ny,
+                     domain.ny + 1, next_row, row_kernel, &tot_u);
+          });
+#elif defined(AA_PATTERN)
+    /* only the push timestep needs the halos, both ways */
+    if (!swapped) {
+      TIMED(profile, PHASE_HALO,
+            halo_exchange(domain, cells));
+    }
+    TIMED(profile, PHASE_TIMESTEP,
+          timestep_aa(params, domain, cells, obstacles, swapped, next_row,
+                      &tot_u));
+    if (!swapped) {
+      TIMED(profile, PHASE_HALO,
+            halo_return(domain, cells));
     }
+    swapped = !swapped;
+#elif defined(OFFLOAD)
+    TIMED(profile, PHASE_HALO,
+          halo_exchange_device(domain, host_cells, cells));
+    TIMED(profile, PHASE_TIMESTEP,
+          timestep_device(params, domain, cells, tmp_cells, obstacles,
+                          next_row, &tot_u));
+#elif defined(SPARSE)
+    TIMED(profile, PHASE_HALO,
+          halo_exchange_sparse(domain, &sparse, cells));
+    TIMED(profile, PHASE_TIMESTEP,
+          timestep_sparse(params, &sparse, cells, tmp_cells, next_row,
+                          &tot_u));
+#else
+    TIMED(profile, PHASE_HALO,
+          halo_exchange(domain, cells));
+    TIMED(profile, PHASE_TIMESTEP,
+          timestep(params, domain, cells, tmp_cells, obstacles, 1,
+                   domain.ny + 1, next_row, row_kernel, &tot_u));
+#endif
+
+#ifndef AA_PATTERN
+    /* the updated grid becomes the current one */
+    t_speed* swap = cells;
+    cells = tmp_cells;
+    tmp_cells = swap;
+#endif
+#ifdef OFFLOAD
+    swap = host_cells;
+    host_cells = host_tmp_cells;
+    host_tmp_cells = swap;
+#endif
+    accelerated = accelerate_next;
+#endif
+
+#ifdef REDUCE_EVERY
+    /* the sums since the last reduction, all av_vels holds when they are
+    ** streamed out */
+#ifdef STREAM_AV_VELS
+    t_accum* const sums = av_vels;
+#else
+    t_accum* const sums = av_vels + reduced;
+#endif
+    sums[tt - reduced] = tot_u;
 
-    halo_exchange(cells, sendbuf, recvbuf, params.nx, params.ny, domain_start,
-                  domain_size, rank, size);
+    /* reduce the sums since the last reduction; a checkpoint needs
+    ** the averages so far */
+    if ((REDUCE_EVERY > 0 && (tt + 1) % REDUCE_EVERY == 0) ||
+#ifdef CHECKPOINT
+        checkpoint ||
+#endif
+        tt == params.maxIters - 1) {
+      TIMED(profile, PHASE_REDUCE,
+            reduce_av_vels(params, domain, sums, tt + 1 - reduced));
+#ifdef CONVERGE
+      steady = converged(recent, tt_start, reduced, sums, tt + 1 - reduced);
+#endif
+#ifdef STREAM_AV_VELS
+      TIMED(profile, PHASE_OUTPUT,
+            stream_av_vels(&stream, reduced, sums, tt + 1 - reduced));
+#endif
+      reduced = tt + 1;
+    }
+#else
+    TIMED(profile, PHASE_REDUCE,
+          av_vel = reduce_av_velocity(params, domain, tot_u));
+#endif
+#endif
+#ifndef REDUCE_EVERY
+#ifdef STREAM_AV_VELS
+    TIMED(profile, PHASE_OUTPUT, stream_av_vels(&stream, tt, &av_vel, 1));
+#else
+    av_vels[tt] = av_vel;
+#endif
+#ifdef CONVERGE
+    steady = converged(recent, tt_start, tt, &av_vel, 1);
+#endif
+#endif
+#ifdef CONVERGE
+    /* stop after the next timestep, as the lattice may already have been
+    ** accelerated for it, or with -DHALO_DEPTH after the one following
+    ** the block already run */
+    if (steady) {
+#ifdef HALO_DEPTH
+      const int end = block_end + 1 > tt + 2 ? block_end + 1 : tt + 2;
+#else
+      const int end = tt + 2;
+#endif
 
-    for (int jj = domain_start; jj < domain_start + domain_size; ++jj) {
-      for (int ii = 0; ii < params.nx; ++ii) {
-        propagate(ii, jj, params, cells, tmp_cells);
-        rebound(ii, jj, params, cells, tmp_cells, obstacles);
+      if (end < params.maxIters) params.maxIters = end;
+    }
+#endif
+#ifdef CHECKPOINT
+    if (checkpoint) {
+#ifdef STREAM_AV_VELS
+      /* a restart carries on from the end of the file */
+      TIMED(profile, PHASE_CHECKPOINT, flush_av_stream(&stream, 1));
+#endif
+#ifdef OFFLOAD
+      TIMED(profile, PHASE_CHECKPOINT,
+            update_host_grid(host_cells);
+            write_checkpoint(params, domain, host_cells, av_vels, tt + 1));
+#elif defined(SPARSE)
+      TIMED(profile, PHASE_CHECKPOINT,
+            t_speed* dense =
+                dense_grid(params, domain, obstacles, &sparse, cells,
+                           tmp_cells);
+            write_checkpoint(params, domain, dense, av_vels, tt + 1);
+            free_grid(dense, 0));
+#else
+#ifdef AA_PATTERN
+      if (swapped) {
+        TIMED(profile, PHASE_CHECKPOINT, unswap_aa(domain, cells));
+        swapped = 0;
       }
+#endif
+      TIMED(profile, PHASE_CHECKPOINT,
+            write_checkpoint(params, domain, cells, av_vels, tt + 1));
+#endif
     }
-    for (int jj = domain_start; jj < domain_start + domain_size; ++jj) {
-      for (int ii = 0; ii < params.nx; ++ii) {
-        collision(ii, jj, params, cells, tmp_cells, obstacles);
+#endif
+#ifdef DIAGNOSE
+    if (diagnose) {
+#ifdef OFFLOAD
+      TIMED(profile, PHASE_DIAGNOSE,
+            update_host_grid(host_cells);
+            write_diagnostics(params, domain, host_cells, host_obstacles,
+                              tt + 1));
+#elif defined(SPARSE)
+      TIMED(profile, PHASE_DIAGNOSE,
+            t_speed* dense =
+                dense_grid(params, domain, obstacles, &sparse, cells,
+                           tmp_cells);
+            write_diagnostics(params, domain, dense, obstacles, tt + 1);
+            free_grid(dense, 0));
+#else
+#ifdef AA_PATTERN
+      if (swapped) {
+        TIMED(profile, PHASE_DIAGNOSE, unswap_aa(domain, cells));
+        swapped = 0;
       }
+#endif
+      TIMED(profile, PHASE_DIAGNOSE,
+            write_diagnostics(params, domain, cells, obstacles, tt + 1));
+#endif
     }
-    av_vels[tt] = av_velocity(params, cells, obstacles, rank, domain_start,
-                              domain_size, 1);
+#endif
 #ifdef DEBUG
     printf("==timestep: %d==\n", tt);
-    printf("av velocity: %.12E\n", av_vels[tt]);
-    printf("tot density: %.12E\n", total_density(params, cells));
+#ifndef REDUCE_EVERY
+    printf("av velocity: %.12E\n", av_vel);
 #endif
+#ifdef SPARSE
+    {
+      t_speed* dense =
+          dense_grid(params, domain, obstacles, &sparse, cells, tmp_cells);
+
+      printf("tot density: %.12E\n", total_density(params, domain, dense));
+      free_grid(dense, 0);
+    }
+#else
+    printf("tot density: %.12E\n", total_density(params, domain, cells));
+#endif
+#endif
+  }
+
+#ifdef AA_PATTERN
+  /* the output reads the usual layout */
+  if (swapped) TIMED(profile, PHASE_SYNC, unswap_aa(domain, cells));
+#endif
+
+#ifdef SPARSE
+  /* the output reads the dense grid */
+  {
+    t_speed* dense = NULL;
+
+    TIMED(profile, PHASE_SYNC,
+          dense = dense_grid(params, domain, obstacles, &sparse, cells,
+                             tmp_cells));
+    free_grid(cells, 0);
+    free_grid(tmp_cells, 0);
+    free_sparse(&sparse);
+    cells = dense;
+    tmp_cells = NULL;
   }
+#endif
+
+#ifdef OFFLOAD
+  /* bring the final lattice back for the output */
+  free_device_grid(cells, host_cells, 1);
+  free_device_grid(tmp_cells, host_tmp_cells, 0);
+  free_device_obstacles(obstacles, host_obstacles, domain.ny + 2);
+  cells = host_cells;
+  tmp_cells = host_tmp_cells;
+  obstacles = host_obstacles;
+#endif
+
+#ifndef BINARY_OUTPUT
+  if (rank == MASTER) {
+    global_cells = alloc_grid(params.ny * params.nx, 0);
 
-  if (size != 1) {
-    sync_grid(cells, rank, domain_start, domain_size, params.ny, params.nx,
-              size);
+    if (global_cells == NULL)
+      die("cannot allocate memory for global_cells", __LINE__, __FILE__);
   }
 
+  TIMED(profile, PHASE_SYNC, sync_grid(params, domain, cells, global_cells));
+#endif
+
   gettimeofday(&timstr, NULL);
   toc = timstr.tv_sec + (timstr.tv_usec / 1000000.0);
   getrusage(RUSAGE_SELF, &ru);
@@ -250,643 +1482,3262 @@ int main(int argc, char* argv[]) {
   timstr = ru.ru_stime;
   systim = timstr.tv_sec + (timstr.tv_usec / 1000000.0);
 
-  /* write final values and free memory */
-  if (rank == MASTER) {
-    printf("==done==\n");
-    printf("Reynolds number:\t\t%.12E\n",
-           calc_reynolds(params, cells, obstacles, params.ny));
-    printf("Elapsed time:\t\t\t%.6lf (s)\n", toc - tic);
-    printf("Elapsed user CPU time:\t\t%.6lf (s)\n", usrtim);
-    printf("Elapsed system CPU time:\t%.6lf (s)\n", systim);
-    write_values(params, cells, obstacles, av_vels);
+  /* write final values and free memory */
+  const t_accum reynolds = calc_reynolds(params, domain, cells, obstacles);
+
+  if (rank == MASTER) {
+    if (outdir != NULL) {
+      printf("==done: %s==\n", outdir);
+    } else {
+      printf("==done==\n");
+    }
+#ifdef CONVERGE
+    printf("Timesteps:\t\t\t%d\n", params.maxIters);
+#endif
+    printf("Reynolds number:\t\t%.12E\n", reynolds);
+    printf("Elapsed time:\t\t\t%.6lf (s)\n", toc - tic);
+    printf("Elapsed user CPU time:\t\t%.6lf (s)\n", usrtim);
+    printf("Elapsed system CPU time:\t%.6lf (s)\n", systim);
+#if defined(STREAM_AV_VELS)
+    TIMED(profile, PHASE_OUTPUT, close_av_stream(&stream));
+#endif
+#if defined(BINARY_OUTPUT) && !defined(STREAM_AV_VELS)
+    TIMED(profile, PHASE_OUTPUT, write_av_vels(params, av_vels));
+#elif !defined(BINARY_OUTPUT)
+    TIMED(profile, PHASE_OUTPUT,
+          write_values(params, global_cells, global_obstacles, av_vels));
+#endif
+  }
+#ifdef BINARY_OUTPUT
+  TIMED(profile, PHASE_OUTPUT, write_state(params, domain, cells, obstacles));
+#endif
+#ifdef CHECK_RESULTS
+  {
+    char refdir[sizeof(cwd) + sizeof(CHECK_DIR) + 1];
+
+    if (CHECK_DIR[0] == '/') {
+      snprintf(refdir, sizeof(refdir), "%s", CHECK_DIR);
+    } else {
+      snprintf(refdir, sizeof(refdir), "%s/%s", cwd, CHECK_DIR);
+    }
+
+    status = check_results(params, domain, cells, obstacles, refdir);
+  }
+#endif
+#ifdef PROFILE
+  report_profile(domain, profile, phase_names, params.maxIters - tt_start);
+#endif
+  finalise(&params, &domain, &cells, &tmp_cells, &obstacles, &global_cells,
+           &global_obstacles, &av_vels);
+
+  if (outdir != NULL && chdir(cwd) != 0)
+    die("could not change back from output directory", __LINE__, __FILE__);
+
+  return status;
+}
+
+int run_ensemble(const char* ensemblefile) {
+  t_member* members = NULL; /* the simulations to run */
+  int count = 0;            /* no. of them */
+  t_map_cache cache = {"", 0, 0, NULL};
+  MPI_Comm comm; /* the processes of this group */
+  int rank;
+  int size;
+  int status = EXIT_SUCCESS; /* failed if any simulation of the group does */
+
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+  if (rank == MASTER) read_ensemble(ensemblefile, &members, &count);
+
+  MPI_Bcast(&count, 1, MPI_INT, MASTER, MPI_COMM_WORLD);
+
+  if (rank != MASTER) {
+    members = malloc(sizeof(t_member) * count);
+
+    if (members == NULL)
+      die("cannot allocate memory for ensemble", __LINE__, __FILE__);
+  }
+
+  MPI_Bcast(members, sizeof(t_member) * count, MPI_BYTE, MASTER,
+            MPI_COMM_WORLD);
+
+  /* groups of consecutive ranks, differing in size by one at most, and
+  ** blocks of consecutive simulations, so that neighbouring lines with
+  ** the same obstacle file share its map */
+  const int groups = count < size ? count : size;
+  const int group = (int)((long)rank * groups / size);
+
+  MPI_Comm_split(MPI_COMM_WORLD, group, rank, &comm);
+
+  for (int mm = group * count / groups; mm < (group + 1) * count / groups;
+       mm++) {
+    if (simulate(comm, members[mm].paramfile, members[mm].obstaclefile, NULL,
+                 members[mm].outdir, &cache) != EXIT_SUCCESS) {
+      status = EXIT_FAILURE;
+    }
+  }
+
+  MPI_Comm_free(&comm);
+  free(cache.map);
+  free(members);
+
+  return status;
+}
+
+int read_ensemble(const char* ensemblefile, t_member** members_ptr,
+                  int* count) {
+  char message[1024]; /* message buffer */
+  char line[3 * NAME_LEN + 64];
+  FILE* fp;          /* file pointer */
+  int allocated = 0; /* no. of members there is room for */
+  int number = 0;    /* no. of the current line */
+
+  fp = fopen(ensemblefile, "r");
+
+  if (fp == NULL) {
+    sprintf(message, "could not open ensemble file: %s", ensemblefile);
+    die(message, __LINE__, __FILE__);
+  }
+
+  *members_ptr = NULL;
+  *count = 0;
+
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    char rest[2];
+
+    ++number;
+
+    if (line[strspn(line, " \t\r\n")] == '\0' || line[0] == '#') continue;
+
+    if (*count == allocated) {
+      allocated = allocated ? 2 * allocated : 16;
+      *members_ptr = realloc(*members_ptr, sizeof(t_member) * allocated);
+
+      if (*members_ptr == NULL)
+        die("cannot allocate memory for ensemble", __LINE__, __FILE__);
+    }
+
+    t_member* member = *members_ptr + *count;
+
+    /* NAME_LEN - 1 = 255 chars at most for each name */
+    if (sscanf(line, "%255s %255s %255s %1s", member->paramfile,
+               member->obstaclefile, member->outdir, rest) != 3) {
+      sprintf(message, "expected 3 names on line %d of ensemble file",
+              number);
+      die(message, __LINE__, __FILE__);
+    }
+
+    ++*count;
+  }
+
+  fclose(fp);
+
+  if (*count == 0) die("no simulations in ensemble file", __LINE__, __FILE__);
+
+  return EXIT_SUCCESS;
+}
+
+int accelerate_flow(const t_param params, const t_domain domain,
+                    t_speed* cells, const t_obstacles* obstacles, int jj) {
+  /* compute weighting factors */
+  t_real w1 = params.density * params.accel / 9;
+  t_real w2 = params.density * params.accel / 36;
+
+  /* modify row jj, the 2nd row of the grid */
+  for (int ii = 1; ii <= domain.nx; ii++) {
+    /* if the cell is not occupied and
+    ** we don't send a negative density */
+    if (!BLOCKED(obstacles, ii, jj) &&
+        (SPEED(cells, ii + jj * domain.width, 3) - w1) > 0 &&
+        (SPEED(cells, ii + jj * domain.width, 6) - w2) > 0 &&
+        (SPEED(cells, ii + jj * domain.width, 7) - w2) > 0) {
+      /* increase 'east-side' densities */
+      SPEED(cells, ii + jj * domain.width, 1) += w1;
+      SPEED(cells, ii + jj * domain.width, 5) += w2;
+      SPEED(cells, ii + jj * domain.width, 8) += w2;
+      /* decrease 'west-side' densities */
+      SPEED(cells, ii + jj * domain.width, 3) -= w1;
+      SPEED(cells, ii + jj * domain.width, 6) -= w2;
+      SPEED(cells, ii + jj * domain.width, 7) -= w2;
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int propagate(int ii, int jj, const t_param params, const t_domain domain,
+              t_speed* cells, t_speed* tmp_cells) {
+  /* determine indices of axis-direction neighbours; the halo
+  ** cells hold the periodic boundary conditions (wrap around) */
+  int y_n = jj + 1;
+  int x_e = ii + 1;
+  int y_s = jj - 1;
+  int x_w = ii - 1;
+  /* propagate densities from neighbouring cells, following
+  ** appropriate directions of travel and writing into
+  ** scratch space grid */
+  SPEED(tmp_cells, ii + jj * domain.width, 0) =
+      SPEED(cells, ii + jj * domain.width, 0); /* central cell, no movement */
+  SPEED(tmp_cells, ii + jj * domain.width, 1) =
+      SPEED(cells, x_w + jj * domain.width, 1); /* east */
+  SPEED(tmp_cells, ii + jj * domain.width, 2) =
+      SPEED(cells, ii + y_s * domain.width, 2); /* north */
+  SPEED(tmp_cells, ii + jj * domain.width, 3) =
+      SPEED(cells, x_e + jj * domain.width, 3); /* west */
+  SPEED(tmp_cells, ii + jj * domain.width, 4) =
+      SPEED(cells, ii + y_n * domain.width, 4); /* south */
+  SPEED(tmp_cells, ii + jj * domain.width, 5) =
+      SPEED(cells, x_w + y_s * domain.width, 5); /* north-east */
+  SPEED(tmp_cells, ii + jj * domain.width, 6) =
+      SPEED(cells, x_e + y_s * domain.width, 6); /* north-west */
+  SPEED(tmp_cells, ii + jj * domain.width, 7) =
+      SPEED(cells, x_e + y_n * domain.width, 7); /* south-west */
+  SPEED(tmp_cells, ii + jj * domain.width, 8) =
+      SPEED(cells, x_w + y_n * domain.width, 8); /* south-east */
+
+  return EXIT_SUCCESS;
+}
+
+int rebound(int ii, int jj, const t_param params, const t_domain domain,
+            t_speed* cells, t_speed* tmp_cells,
+            const t_obstacles* obstacles) {
+  /* if the cell contains an obstacle */
+  if (BLOCKED(obstacles, ii, jj)) {
+    /* called after propagate, so taking values from scratch space
+    ** mirroring, and writing into main grid */
+    SPEED(cells, ii + jj * domain.width, 1) =
+        SPEED(tmp_cells, ii + jj * domain.width, 3);
+    SPEED(cells, ii + jj * domain.width, 2) =
+        SPEED(tmp_cells, ii + jj * domain.width, 4);
+    SPEED(cells, ii + jj * domain.width, 3) =
+        SPEED(tmp_cells, ii + jj * domain.width, 1);
+    SPEED(cells, ii + jj * domain.width, 4) =
+        SPEED(tmp_cells, ii + jj * domain.width, 2);
+    SPEED(cells, ii + jj * domain.width, 5) =
+        SPEED(tmp_cells, ii + jj * domain.width, 7);
+    SPEED(cells, ii + jj * domain.width, 6) =
+        SPEED(tmp_cells, ii + jj * domain.width, 8);
+    SPEED(cells, ii + jj * domain.width, 7) =
+        SPEED(tmp_cells, ii + jj * domain.width, 5);
+    SPEED(cells, ii + jj * domain.width, 8) =
+        SPEED(tmp_cells, ii + jj * domain.width, 6);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int collision(int ii, int jj, const t_param params, const t_domain domain,
+              t_speed* cells, t_speed* tmp_cells,
+              const t_obstacles* obstacles) {
+  const t_real c_sq = (t_real)1 / 3; /* square of speed of sound */
+  const t_real w0 = (t_real)4 / 9;   /* weighting factor */
+  const t_real w1 = (t_real)1 / 9;   /* weighting factor */
+  const t_real w2 = (t_real)1 / 36;  /* weighting factor */
+  /* don't consider occupied cells */
+  if (!BLOCKED(obstacles, ii, jj)) {
+    /* compute local density total */
+    t_real local_density = 0;
+
+    for (int kk = 0; kk < NSPEEDS; kk++) {
+      local_density += SPEED(tmp_cells, ii + jj * domain.width, kk);
+    }
+
+    /* compute x velocity component */
+    t_real u_x = (SPEED(tmp_cells, ii + jj * domain.width, 1) +
+                 SPEED(tmp_cells, ii + jj * domain.width, 5) +
+                 SPEED(tmp_cells, ii + jj * domain.width, 8) -
+                 (SPEED(tmp_cells, ii + jj * domain.width, 3) +
+                  SPEED(tmp_cells, ii + jj * domain.width, 6) +
+                  SPEED(tmp_cells, ii + jj * domain.width, 7))) /
+                local_density;
+    /* compute y velocity component */
+    t_real u_y = (SPEED(tmp_cells, ii + jj * domain.width, 2) +
+                 SPEED(tmp_cells, ii + jj * domain.width, 5) +
+                 SPEED(tmp_cells, ii + jj * domain.width, 6) -
+                 (SPEED(tmp_cells, ii + jj * domain.width, 4) +
+                  SPEED(tmp_cells, ii + jj * domain.width, 7) +
+                  SPEED(tmp_cells, ii + jj * domain.width, 8))) /
+                local_density;
+
+    /* velocity squared */
+    t_real u_sq = u_x * u_x + u_y * u_y;
+
+    /* directional velocity components */
+    t_real u[NSPEEDS];
+    u[1] = u_x;        /* east */
+    u[2] = u_y;        /* north */
+    u[3] = -u_x;       /* west */
+    u[4] = -u_y;       /* south */
+    u[5] = u_x + u_y;  /* north-east */
+    u[6] = -u_x + u_y; /* north-west */
+    u[7] = -u_x - u_y; /* south-west */
+    u[8] = u_x - u_y;  /* south-east */
+
+    /* equilibrium densities */
+    t_real d_equ[NSPEEDS];
+    /* zero velocity density: weight w0 */
+    d_equ[0] = w0 * local_density * (1 - u_sq / (2 * c_sq));
+    /* axis speeds: weight w1 */
+    d_equ[1] = w1 * local_density *
+               (1 + u[1] / c_sq + (u[1] * u[1]) / (2 * c_sq * c_sq) -
+                u_sq / (2 * c_sq));
+    d_equ[2] = w1 * local_density *
+               (1 + u[2] / c_sq + (u[2] * u[2]) / (2 * c_sq * c_sq) -
+                u_sq / (2 * c_sq));
+    d_equ[3] = w1 * local_density *
+               (1 + u[3] / c_sq + (u[3] * u[3]) / (2 * c_sq * c_sq) -
+                u_sq / (2 * c_sq));
+    d_equ[4] = w1 * local_density *
+               (1 + u[4] / c_sq + (u[4] * u[4]) / (2 * c_sq * c_sq) -
+                u_sq / (2 * c_sq));
+    /* diagonal speeds: weight w2 */
+    d_equ[5] = w2 * local_density *
+               (1 + u[5] / c_sq + (u[5] * u[5]) / (2 * c_sq * c_sq) -
+                u_sq / (2 * c_sq));
+    d_equ[6] = w2 * local_density *
+               (1 + u[6] / c_sq + (u[6] * u[6]) / (2 * c_sq * c_sq) -
+                u_sq / (2 * c_sq));
+    d_equ[7] = w2 * local_density *
+               (1 + u[7] / c_sq + (u[7] * u[7]) / (2 * c_sq * c_sq) -
+                u_sq / (2 * c_sq));
+    d_equ[8] = w2 * local_density *
+               (1 + u[8] / c_sq + (u[8] * u[8]) / (2 * c_sq * c_sq) -
+                u_sq / (2 * c_sq));
+
+    /* relaxation step */
+    for (int kk = 0; kk < NSPEEDS; kk++) {
+      SPEED(cells, ii + jj * domain.width, kk) =
+          SPEED(tmp_cells, ii + jj * domain.width, kk) +
+          params.omega *
+              (d_equ[kk] - SPEED(tmp_cells, ii + jj * domain.width, kk));
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int timestep(const t_param params, const t_domain domain, t_speed* cells,
+             t_speed* tmp_cells, const t_obstacles* obstacles, int row_start,
+             int row_end, int accel_row, t_row_kernel row_kernel,
+             t_accum* tot_u) {
+  t_accum u = 0; /* velocity norms of the rows updated here */
+
+  /* the rows are independent, so with OpenMP each thread takes a block
+  ** of them; the same static split is used to first touch the grids */
+#pragma omp parallel for schedule(static) reduction(+ : u)
+  for (int jj = row_start; jj < row_end; jj++) {
+    row_kernel(params, domain, cells, tmp_cells, obstacles, jj, &u);
+
+    /* the velocity norms above are from before the acceleration */
+    if (jj == accel_row)
+      accelerate_flow(params, domain, tmp_cells, obstacles, jj);
+  }
+
+  *tot_u += u;
+
+  return EXIT_SUCCESS;
+}
+
+int timestep_block(const t_param params, const t_domain domain,
+                   t_speed* cells, t_speed* tmp_cells,
+                   const t_obstacles* obstacles, int steps,
+                   int accelerate_last, t_row_kernel row_kernel,
+                   t_accum* tot_u) {
+  /* step s updates rows first + s..last - s */
+  const int first = 2 - HALO_ROWS;
+  const int last = domain.ny + HALO_ROWS - 1;
+  /* local index of the accelerated row, give or take the periodic wrap */
+  const int accel_row = params.ny - 2 - domain.y_start + 1;
+
+  for (int s = 0; s < steps; s++) tot_u[s] = 0;
+
+#pragma omp parallel
+  for (int wave = first; wave <= last + 2 * (steps - 1); wave++) {
+    /* the steps of a wave read and write rows at least two apart in
+    ** each grid, so they are independent */
+#pragma omp for schedule(static)
+    for (int s = 0; s < steps; s++) {
+      const int jj = wave - 2 * s;
+      t_speed* in = s % 2 ? tmp_cells : cells;
+      t_speed* out = s % 2 ? cells : tmp_cells;
+      t_accum u = 0;
+
+      if (jj < first + s || jj > last - s) continue;
+
+      row_kernel(params, domain, in, out, obstacles, jj, &u);
+
+      if (jj >= 1 && jj <= domain.ny) tot_u[s] += u;
+
+      /* the next step reads this row from the next wave on: every copy
+      ** of the accelerated row is accelerated, and the halo columns are
+      ** filled in as halo_exchange() would have */
+      if (s + 1 < steps || accelerate_last) {
+        for (int wrap = -params.ny; wrap <= params.ny; wrap += params.ny) {
+          if (jj == accel_row + wrap)
+            accelerate_flow(params, domain, out, obstacles, jj);
+        }
+      }
+      if (s + 1 < steps) wrap_row(domain, out, jj);
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int timestep_row(const t_param params, const t_domain domain, t_speed* cells,
+                 t_speed* tmp_cells, const t_obstacles* obstacles, int jj,
+                 t_accum* tot_u) {
+  for (int span = obstacles->row_spans[jj]; span < obstacles->row_spans[jj + 1];
+       span++) {
+    timestep_cells(params, domain, cells, tmp_cells, obstacles, jj,
+                   obstacles->spans[2 * span], obstacles->spans[2 * span + 1],
+                   tot_u);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int timestep_cells(const t_param params, const t_domain domain,
+                   t_speed* cells, t_speed* tmp_cells,
+                   const t_obstacles* obstacles, int jj, int ii_start,
+                   int ii_end, t_accum* tot_u) {
+  const t_real w0 = (t_real)4 / 9;  /* weighting factor */
+  const t_real w1 = (t_real)1 / 9;  /* weighting factor */
+  const t_real w2 = (t_real)1 / 36; /* weighting factor */
+  const t_real c2 = 4.5;            /* 1 / (2 c_sq^2), for the u^2 terms */
+  t_accum u_sum = 0;                /* accumulated velocity norms */
+
+  /* indices of the rows above and below, which may be halos */
+  const int y_n = jj + 1;
+  const int y_s = jj - 1;
+
+  for (int ii = ii_start; ii < ii_end; ii++) {
+    const int x_e = ii + 1;
+    const int x_w = ii - 1;
+    const int index = ii + jj * domain.width;
+
+    /* pull densities from neighbouring cells */
+    const t_real s0 = SPEED(cells, index, 0);                 /* centre */
+    const t_real s1 = SPEED(cells, x_w + jj * domain.width, 1);  /* east */
+    const t_real s2 = SPEED(cells, ii + y_s * domain.width, 2);  /* north */
+    const t_real s3 = SPEED(cells, x_e + jj * domain.width, 3);  /* west */
+    const t_real s4 = SPEED(cells, ii + y_n * domain.width, 4);  /* south */
+    const t_real s5 = SPEED(cells, x_w + y_s * domain.width, 5); /* n-east */
+    const t_real s6 = SPEED(cells, x_e + y_s * domain.width, 6); /* n-west */
+    const t_real s7 = SPEED(cells, x_e + y_n * domain.width, 7); /* s-west */
+    const t_real s8 = SPEED(cells, x_w + y_n * domain.width, 8); /* s-east */
+
+    if (BLOCKED(obstacles, ii, jj)) {
+      /* bounce back by mirroring the incoming densities */
+      SPEED(tmp_cells, index, 0) = s0;
+      SPEED(tmp_cells, index, 1) = s3;
+      SPEED(tmp_cells, index, 2) = s4;
+      SPEED(tmp_cells, index, 3) = s1;
+      SPEED(tmp_cells, index, 4) = s2;
+      SPEED(tmp_cells, index, 5) = s7;
+      SPEED(tmp_cells, index, 6) = s8;
+      SPEED(tmp_cells, index, 7) = s5;
+      SPEED(tmp_cells, index, 8) = s6;
+      continue;
+    }
+
+    /* local density and velocity */
+    const t_real local_density = s0 + s1 + s2 + s3 + s4 + s5 + s6 + s7 + s8;
+    const t_real inv_density = 1 / local_density;
+    const t_real u_x = (s1 + s5 + s8 - (s3 + s6 + s7)) * inv_density;
+    const t_real u_y = (s2 + s5 + s6 - (s4 + s7 + s8)) * inv_density;
+    const t_real u_sq = u_x * u_x + u_y * u_y;
+    const t_real u5 = u_x + u_y;  /* north-east */
+    const t_real u6 = -u_x + u_y; /* north-west */
+
+    /* with c_sq = 1/3 the equilibrium term
+    ** 1 + u/c_sq + u^2/(2 c_sq^2) - u_sq/(2 c_sq)
+    ** reduces to c + 3u + 4.5u^2 with c = 1 - 1.5u_sq */
+    const t_real c = 1 - (t_real)1.5 * u_sq;
+    const t_real d0 = w0 * local_density;
+    const t_real d1 = w1 * local_density;
+    const t_real d2 = w2 * local_density;
+
+    /* relaxation step */
+    SPEED(tmp_cells, index, 0) = s0 + params.omega * (d0 * c - s0);
+    SPEED(tmp_cells, index, 1) =
+        s1 + params.omega * (d1 * (c + 3 * u_x + c2 * u_x * u_x) - s1);
+    SPEED(tmp_cells, index, 2) =
+        s2 + params.omega * (d1 * (c + 3 * u_y + c2 * u_y * u_y) - s2);
+    SPEED(tmp_cells, index, 3) =
+        s3 + params.omega * (d1 * (c - 3 * u_x + c2 * u_x * u_x) - s3);
+    SPEED(tmp_cells, index, 4) =
+        s4 + params.omega * (d1 * (c - 3 * u_y + c2 * u_y * u_y) - s4);
+    SPEED(tmp_cells, index, 5) =
+        s5 + params.omega * (d2 * (c + 3 * u5 + c2 * u5 * u5) - s5);
+    SPEED(tmp_cells, index, 6) =
+        s6 + params.omega * (d2 * (c + 3 * u6 + c2 * u6 * u6) - s6);
+    SPEED(tmp_cells, index, 7) =
+        s7 + params.omega * (d2 * (c - 3 * u5 + c2 * u5 * u5) - s7);
+    SPEED(tmp_cells, index, 8) =
+        s8 + params.omega * (d2 * (c - 3 * u6 + c2 * u6 * u6) - s8);
+
+    /* relaxation conserves mass and momentum, so the velocity of the
+    ** updated cell is the one computed above */
+    u_sum += sqrt(u_sq);
+  }
+
+  *tot_u += u_sum;
+
+  return EXIT_SUCCESS;
+}
+
+#ifdef AA_PATTERN
+int timestep_aa(const t_param params, const t_domain domain, t_speed* cells,
+                const t_obstacles* obstacles, int swapped, int accel_row,
+                t_accum* tot_u) {
+  t_accum u = 0; /* velocity norms of the owned rows */
+
+  /* every density is read and written by a single cell, so the cells are
+  ** as independent as with two lattices */
+#pragma omp parallel for schedule(static) reduction(+ : u)
+  for (int jj = 1; jj <= domain.ny; jj++) {
+    for (int span = obstacles->row_spans[jj];
+         span < obstacles->row_spans[jj + 1]; span++) {
+      timestep_aa_cells(params, domain, cells, obstacles, swapped, jj,
+                        obstacles->spans[2 * span],
+                        obstacles->spans[2 * span + 1], jj == accel_row, &u);
+    }
+  }
+
+  *tot_u += u;
+
+  return EXIT_SUCCESS;
+}
+
+int timestep_aa_cells(const t_param params, const t_domain domain,
+                      t_speed* cells, const t_obstacles* obstacles,
+                      int swapped, int jj, int ii_start, int ii_end,
+                      int accelerate, t_accum* tot_u) {
+  const t_real w0 = (t_real)4 / 9;  /* weighting factor */
+  const t_real w1 = (t_real)1 / 9;  /* weighting factor */
+  const t_real w2 = (t_real)1 / 36; /* weighting factor */
+  const t_real c2 = 4.5;            /* 1 / (2 c_sq^2), for the u^2 terms */
+  /* the acceleration of accelerate_flow() */
+  const t_real a1 = params.density * params.accel / 9;
+  const t_real a2 = params.density * params.accel / 36;
+  const int width = domain.width;
+  /* the index offset of the neighbour each speed moves to, and the speed
+  ** moving the other way */
+  const int offset[NSPEEDS] = {0,          1,         width,
+                               -1,         -width,    width + 1,
+                               width - 1,  -width - 1, -width + 1};
+  const int opposite[NSPEEDS] = {0, 3, 4, 1, 2, 7, 8, 5, 6};
+  t_accum u_sum = 0; /* accumulated velocity norms */
+
+  for (int ii = ii_start; ii < ii_end; ii++) {
+    const int index = ii + jj * width;
+    t_real s[NSPEEDS]; /* the densities moving into the cell */
+    t_real d[NSPEEDS]; /* and out of it */
+
+    for (int kk = 0; kk < NSPEEDS; kk++) {
+      s[kk] = swapped ? SPEED(cells, index, opposite[kk])
+                      : SPEED(cells, index - offset[kk], kk);
+    }
+
+    if (BLOCKED(obstacles, ii, jj)) {
+      /* bounce back by mirroring the incoming densities */
+      for (int kk = 0; kk < NSPEEDS; kk++) d[kk] = s[opposite[kk]];
+    } else {
+      /* as in timestep_cells() */
+      const t_real local_density =
+          s[0] + s[1] + s[2] + s[3] + s[4] + s[5] + s[6] + s[7] + s[8];
+      const t_real inv_density = 1 / local_density;
+      const t_real u_x = (s[1] + s[5] + s[8] - (s[3] + s[6] + s[7])) *
+                         inv_density;
+      const t_real u_y = (s[2] + s[5] + s[6] - (s[4] + s[7] + s[8])) *
+                         inv_density;
+      const t_real u_sq = u_x * u_x + u_y * u_y;
+      const t_real u5 = u_x + u_y;  /* north-east */
+      const t_real u6 = -u_x + u_y; /* north-west */
+      const t_real c = 1 - (t_real)1.5 * u_sq;
+      const t_real d0 = w0 * local_density;
+      const t_real d1 = w1 * local_density;
+      const t_real d2 = w2 * local_density;
+
+      /* relaxation step */
+      d[0] = s[0] + params.omega * (d0 * c - s[0]);
+      d[1] = s[1] + params.omega * (d1 * (c + 3 * u_x + c2 * u_x * u_x) - s[1]);
+      d[2] = s[2] + params.omega * (d1 * (c + 3 * u_y + c2 * u_y * u_y) - s[2]);
+      d[3] = s[3] + params.omega * (d1 * (c - 3 * u_x + c2 * u_x * u_x) - s[3]);
+      d[4] = s[4] + params.omega * (d1 * (c - 3 * u_y + c2 * u_y * u_y) - s[4]);
+      d[5] = s[5] + params.omega * (d2 * (c + 3 * u5 + c2 * u5 * u5) - s[5]);
+      d[6] = s[6] + params.omega * (d2 * (c + 3 * u6 + c2 * u6 * u6) - s[6]);
+      d[7] = s[7] + params.omega * (d2 * (c - 3 * u5 + c2 * u5 * u5) - s[7]);
+      d[8] = s[8] + params.omega * (d2 * (c - 3 * u6 + c2 * u6 * u6) - s[8]);
+
+      u_sum += sqrt(u_sq);
+
+      /* accelerate_flow() for the next timestep, whose densities these
+      ** are wherever they are stored */
+      if (accelerate && (d[3] - a1) > 0 && (d[6] - a2) > 0 &&
+          (d[7] - a2) > 0) {
+        d[1] += a1;
+        d[5] += a2;
+        d[8] += a2;
+        d[3] -= a1;
+        d[6] -= a2;
+        d[7] -= a2;
+      }
+    }
+
+    for (int kk = 0; kk < NSPEEDS; kk++) {
+      if (swapped) {
+        SPEED(cells, index, kk) = d[kk];
+      } else {
+        SPEED(cells, index + offset[kk], opposite[kk]) = d[kk];
+      }
+    }
+  }
+
+  *tot_u += u_sum;
+
+  return EXIT_SUCCESS;
+}
+
+int unswap_aa(const t_domain domain, t_speed* cells) {
+  const int width = domain.width;
+  /* the neighbour each speed moves to, as in timestep_aa_cells() */
+  const int dx[NSPEEDS] = {0, 1, 0, -1, 0, 1, -1, -1, 1};
+  const int dy[NSPEEDS] = {0, 0, 1, 0, -1, 1, 1, -1, -1};
+  const int opposite[NSPEEDS] = {0, 3, 4, 1, 2, 7, 8, 5, 6};
+
+  /* speed kk of a cell is found in the opposite speed of the neighbour it
+  ** moves to, and the other way around, so the pairs of owned cells swap
+  ** and the owned cells next to a halo copy from it. Each density is in
+  ** one pair only, so this is safe across threads. */
+#pragma omp parallel for schedule(static)
+  for (int jj = 1; jj <= domain.ny; jj++) {
+    for (int ii = 1; ii <= domain.nx; ii++) {
+      for (int kk = 1; kk < NSPEEDS; kk++) {
+        const int xx = ii + dx[kk];
+        const int yy = jj + dy[kk];
+        const int owned = xx >= 1 && xx <= domain.nx && yy >= 1 &&
+                          yy <= domain.ny;
+        t_real* here = &SPEED(cells, ii + jj * width, kk);
+        t_real* there = &SPEED(cells, xx + yy * width, opposite[kk]);
+
+        if (!owned) {
+          *here = *there;
+        } else if (kk < opposite[kk]) {
+          const t_real swap = *here;
+          *here = *there;
+          *there = swap;
+        }
+      }
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+#endif
+
+#ifdef SPARSE
+int init_sparse(const t_domain domain, const t_obstacles* obstacles,
+                t_sparse* sparse, t_speed** cells_ptr,
+                t_speed** tmp_cells_ptr) {
+  const int width = domain.width;
+  /* the neighbour each speed moves to, as in timestep_aa_cells() */
+  const int dx[NSPEEDS] = {0, 1, 0, -1, 0, 1, -1, -1, 1};
+  const int dy[NSPEEDS] = {0, 0, 1, 0, -1, 1, 1, -1, -1};
+  const int opposite[NSPEEDS] = {0, 3, 4, 1, 2, 7, 8, 5, 6};
+  t_speed* dense = *cells_ptr;
+  t_speed* cells;
+  t_speed* tmp_cells;
+  int* map;
+
+  sparse->row_starts = malloc(sizeof(int) * (domain.ny + 3));
+
+  if (sparse->row_starts == NULL)
+    die("cannot allocate memory for sparse rows", __LINE__, __FILE__);
+
+  sparse->row_starts[0] = 0;
+  for (int jj = 0; jj <= domain.ny + 1; jj++) {
+    int count = 0;
+
+    for (int ii = 1; ii <= domain.nx; ii++)
+      count += !BLOCKED(obstacles, ii, jj);
+
+    sparse->row_starts[jj + 1] = sparse->row_starts[jj] + count;
+  }
+  sparse->ncells = sparse->row_starts[domain.ny + 2];
+  sparse->owned_end = sparse->row_starts[domain.ny + 1];
+
+  const int first = sparse->row_starts[1];
+  const int owned = sparse->owned_end - first;
+
+  map = sparse_map(domain, obstacles, sparse);
+  cells = alloc_grid(sparse->ncells, 0);
+  tmp_cells = alloc_grid(sparse->ncells, 0);
+  sparse->neighbours = malloc(sizeof(int) * (NSPEEDS - 1) * (owned + 1));
+
+  if (cells == NULL || tmp_cells == NULL || sparse->neighbours == NULL)
+    die("cannot allocate memory for sparse grids", __LINE__, __FILE__);
+
+  /* the densities of the halo obstacle cells too */
+  halo_exchange(domain, dense);
+
+  /* the same static split of the rows as the kernel's of the cells, give
+  ** or take, to first touch the grids */
+#pragma omp parallel for schedule(static)
+  for (int jj = 0; jj <= domain.ny + 1; jj++) {
+    for (int ii = 1; ii <= domain.nx; ii++) {
+      const int index = map[ii + jj * width];
+
+      if (index < 0) continue;
+
+      for (int kk = 0; kk < NSPEEDS; kk++) {
+        SPEED(cells, index, kk) = SPEED(dense, ii + jj * width, kk);
+        SPEED(tmp_cells, index, kk) = SPEED(dense, ii + jj * width, kk);
+      }
+
+      if (jj < 1 || jj > domain.ny) continue;
+
+      for (int kk = 1; kk < NSPEEDS; kk++) {
+        const int from = ii - dx[kk] + (jj - dy[kk]) * width;
+        int* neighbour =
+            &sparse->neighbours[(NSPEEDS - 1) * (index - first) + kk - 1];
+
+        *neighbour = map[from];
+
+        /* what the obstacle cell would bounce back next */
+        if (*neighbour < 0)
+          SPEED(tmp_cells, index, opposite[kk]) = SPEED(dense, from, kk);
+      }
+    }
+  }
+
+  free(map);
+  free_grid(*cells_ptr, 0);
+  free_grid(*tmp_cells_ptr, 0);
+  *cells_ptr = cells;
+  *tmp_cells_ptr = tmp_cells;
+
+#ifdef THIN_HALO
+  /* only the speeds moving into each halo are pulled out of it */
+  const int to_north[3] = {2, 5, 6};
+  const int to_south[3] = {4, 7, 8};
+  const int count = 3;
+#else
+  const int* to_north = NULL;
+  const int* to_south = NULL;
+  const int count = NSPEEDS;
+#endif
+  const int* starts = sparse->row_starts;
+
+  block_type(cells, starts[domain.ny + 1] - starts[domain.ny], 1, 0,
+             to_north, count, &sparse->north_rows);
+  block_type(cells, starts[2] - starts[1], 1, 0, to_south, count,
+             &sparse->south_rows);
+  block_type(cells, starts[domain.ny + 2] - starts[domain.ny + 1], 1, 0,
+             to_south, count, &sparse->north_halo);
+  block_type(cells, starts[1] - starts[0], 1, 0, to_north, count,
+             &sparse->south_halo);
+
+  return EXIT_SUCCESS;
+}
+
+void free_sparse(t_sparse* sparse) {
+  free(sparse->row_starts);
+  sparse->row_starts = NULL;
+  free(sparse->neighbours);
+  sparse->neighbours = NULL;
+
+  MPI_Type_free(&sparse->north_rows);
+  MPI_Type_free(&sparse->south_rows);
+  MPI_Type_free(&sparse->north_halo);
+  MPI_Type_free(&sparse->south_halo);
+}
+
+int* sparse_map(const t_domain domain, const t_obstacles* obstacles,
+                const t_sparse* sparse) {
+  const int width = domain.width;
+  int* map = malloc(sizeof(int) * width * (domain.ny + 2));
+
+  if (map == NULL)
+    die("cannot allocate memory for sparse map", __LINE__, __FILE__);
+
+  for (int jj = 0; jj <= domain.ny + 1; jj++) {
+    int index = sparse->row_starts[jj];
+
+    for (int ii = 1; ii <= domain.nx; ii++)
+      map[ii + jj * width] = BLOCKED(obstacles, ii, jj) ? -1 : index++;
+
+    map[jj * width] = map[domain.nx + jj * width];
+    map[domain.nx + 1 + jj * width] = map[1 + jj * width];
+  }
+
+  return map;
+}
+
+t_speed* dense_grid(const t_param params, const t_domain domain,
+                    const t_obstacles* obstacles, const t_sparse* sparse,
+                    t_speed* cells, t_speed* tmp_cells) {
+  const int width = domain.width;
+  const int dx[NSPEEDS] = {0, 1, 0, -1, 0, 1, -1, -1, 1};
+  const int dy[NSPEEDS] = {0, 0, 1, 0, -1, 1, 1, -1, -1};
+  const int opposite[NSPEEDS] = {0, 3, 4, 1, 2, 7, 8, 5, 6};
+  /* the densities initialise() starts every cell with */
+  const t_real w0 = params.density * (t_real)4 / 9;
+  const t_real w1 = params.density / 9;
+  const t_real w2 = params.density / 36;
+  const t_real initial[NSPEEDS] = {w0, w1, w1, w1, w1, w2, w2, w2, w2};
+  t_speed* dense = alloc_grid((domain.ny + 2) * width, 0);
+  int* map = sparse_map(domain, obstacles, sparse);
+
+  if (dense == NULL)
+    die("cannot allocate memory for dense grid", __LINE__, __FILE__);
+
+#pragma omp parallel for schedule(static)
+  for (int jj = 1; jj <= domain.ny; jj++) {
+    for (int ii = 1; ii <= domain.nx; ii++) {
+      const int index = map[ii + jj * width];
+
+      for (int kk = 0; kk < NSPEEDS; kk++) {
+        if (index >= 0) {
+          SPEED(dense, ii + jj * width, kk) = SPEED(cells, index, kk);
+        } else {
+          /* an obstacle cell holds the densities pulled from its
+          ** neighbours in the last timestep, mirrored. Those from other
+          ** obstacle cells, and its speed 0, never change from where
+          ** they started: the only ones that do come from the fluid. */
+          const int to = map[ii + dx[kk] + (jj + dy[kk]) * width];
+
+          SPEED(dense, ii + jj * width, kk) =
+              kk > 0 && to >= 0 ? SPEED(tmp_cells, to, opposite[kk])
+                                : initial[kk];
+        }
+      }
+    }
+  }
+
+  free(map);
+
+  return dense;
+}
+
+int timestep_sparse(const t_param params, const t_sparse* sparse,
+                    t_speed* cells, t_speed* tmp_cells, int accel_row,
+                    t_accum* tot_u) {
+  const t_real w0 = (t_real)4 / 9;  /* weighting factor */
+  const t_real w1 = (t_real)1 / 9;  /* weighting factor */
+  const t_real w2 = (t_real)1 / 36; /* weighting factor */
+  const t_real c2 = 4.5;            /* 1 / (2 c_sq^2), for the u^2 terms */
+  const int opposite[NSPEEDS] = {0, 3, 4, 1, 2, 7, 8, 5, 6};
+  const int first = sparse->row_starts[1];
+  t_accum u = 0; /* velocity norms of the owned cells */
+
+  /* every cell is fluid, and only reads and writes its own densities in
+  ** tmp_cells, so the cells are independent */
+#pragma omp parallel for schedule(static) reduction(+ : u)
+  for (int index = first; index < sparse->owned_end; index++) {
+    const int* from = &sparse->neighbours[(NSPEEDS - 1) * (index - first)];
+    t_real s[NSPEEDS]; /* the densities moving into the cell */
+
+    s[0] = SPEED(cells, index, 0);
+    for (int kk = 1; kk < NSPEEDS; kk++) {
+      s[kk] = from[kk - 1] >= 0 ? SPEED(cells, from[kk - 1], kk)
+                                : SPEED(tmp_cells, index, opposite[kk]);
+    }
+
+    /* as in timestep_cells() */
+    const t_real local_density =
+        s[0] + s[1] + s[2] + s[3] + s[4] + s[5] + s[6] + s[7] + s[8];
+    const t_real inv_density = 1 / local_density;
+    const t_real u_x = (s[1] + s[5] + s[8] - (s[3] + s[6] + s[7])) *
+                       inv_density;
+    const t_real u_y = (s[2] + s[5] + s[6] - (s[4] + s[7] + s[8])) *
+                       inv_density;
+    const t_real u_sq = u_x * u_x + u_y * u_y;
+    const t_real u5 = u_x + u_y;  /* north-east */
+    const t_real u6 = -u_x + u_y; /* north-west */
+    const t_real c = 1 - (t_real)1.5 * u_sq;
+    const t_real d0 = w0 * local_density;
+    const t_real d1 = w1 * local_density;
+    const t_real d2 = w2 * local_density;
+
+    /* relaxation step */
+    SPEED(tmp_cells, index, 0) = s[0] + params.omega * (d0 * c - s[0]);
+    SPEED(tmp_cells, index, 1) =
+        s[1] + params.omega * (d1 * (c + 3 * u_x + c2 * u_x * u_x) - s[1]);
+    SPEED(tmp_cells, index, 2) =
+        s[2] + params.omega * (d1 * (c + 3 * u_y + c2 * u_y * u_y) - s[2]);
+    SPEED(tmp_cells, index, 3) =
+        s[3] + params.omega * (d1 * (c - 3 * u_x + c2 * u_x * u_x) - s[3]);
+    SPEED(tmp_cells, index, 4) =
+        s[4] + params.omega * (d1 * (c - 3 * u_y + c2 * u_y * u_y) - s[4]);
+    SPEED(tmp_cells, index, 5) =
+        s[5] + params.omega * (d2 * (c + 3 * u5 + c2 * u5 * u5) - s[5]);
+    SPEED(tmp_cells, index, 6) =
+        s[6] + params.omega * (d2 * (c + 3 * u6 + c2 * u6 * u6) - s[6]);
+    SPEED(tmp_cells, index, 7) =
+        s[7] + params.omega * (d2 * (c - 3 * u5 + c2 * u5 * u5) - s[7]);
+    SPEED(tmp_cells, index, 8) =
+        s[8] + params.omega * (d2 * (c - 3 * u6 + c2 * u6 * u6) - s[8]);
+
+    u += sqrt(u_sq);
+  }
+
+  *tot_u += u;
+
+  /* after the whole grid, as in timestep() after the row */
+  if (accel_row > 0) accelerate_sparse(params, sparse, tmp_cells, accel_row);
+
+  return EXIT_SUCCESS;
+}
+
+int accelerate_sparse(const t_param params, const t_sparse* sparse,
+                      t_speed* cells, int jj) {
+  /* compute weighting factors */
+  t_real w1 = params.density * params.accel / 9;
+  t_real w2 = params.density * params.accel / 36;
+
+  /* the fluid cells of row jj, as in accelerate_flow() */
+  for (int index = sparse->row_starts[jj]; index < sparse->row_starts[jj + 1];
+       index++) {
+    if ((SPEED(cells, index, 3) - w1) > 0 &&
+        (SPEED(cells, index, 6) - w2) > 0 &&
+        (SPEED(cells, index, 7) - w2) > 0) {
+      /* increase 'east-side' densities */
+      SPEED(cells, index, 1) += w1;
+      SPEED(cells, index, 5) += w2;
+      SPEED(cells, index, 8) += w2;
+      /* decrease 'west-side' densities */
+      SPEED(cells, index, 3) -= w1;
+      SPEED(cells, index, 6) -= w2;
+      SPEED(cells, index, 7) -= w2;
+    }
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int halo_exchange_sparse(const t_domain domain, const t_sparse* sparse,
+                         t_speed* cells) {
+  const int* starts = sparse->row_starts;
+
+  /* a halo row is the same cells of the grid as the owned row it comes
+  ** from, so the counts match */
+  MPI_Sendrecv(&SPEED(cells, starts[1], 0), 1, sparse->south_rows,
+               domain.south, 0, &SPEED(cells, starts[domain.ny + 1], 0), 1,
+               sparse->north_halo, domain.north, 0, domain.comm,
+               MPI_STATUS_IGNORE);
+  MPI_Sendrecv(&SPEED(cells, starts[domain.ny], 0), 1, sparse->north_rows,
+               domain.north, 1, &SPEED(cells, starts[0], 0), 1,
+               sparse->south_halo, domain.south, 1, domain.comm,
+               MPI_STATUS_IGNORE);
+
+  return EXIT_SUCCESS;
+}
+#endif
+
+#ifdef SIMD_KERNELS
+/*
+** The SIMD kernels update 8 (AVX2) or 16 (AVX-512) neighbouring cells of
+** a span of a row at a time, leaving any remainder of each span to the
+** scalar kernel. Thanks to the halo cells every neighbour is an unaligned
+** load from the same plane offset by one cell. Obstacle cells are handled
+** by blending the bounced-back densities in under a bitmask rather than
+** branching.
+*/
+__attribute__((target("avx2,fma"))) int timestep_row_avx2(
+    const t_param params, const t_domain domain, t_speed* cells,
+    t_speed* tmp_cells, const t_obstacles* obstacles, int jj, t_accum* tot_u) {
+  const int row = jj * domain.width;
+  const int row_n = (jj + 1) * domain.width;
+  const int row_s = (jj - 1) * domain.width;
+  const __m256 one = _mm256_set1_ps(1.f);
+  const __m256 three = _mm256_set1_ps(3.f);
+  const __m256 four_half = _mm256_set1_ps(4.5f);
+  const __m256 one_half = _mm256_set1_ps(1.5f);
+  const __m256 w0 = _mm256_set1_ps(4.f / 9.f);
+  const __m256 w1 = _mm256_set1_ps(1.f / 9.f);
+  const __m256 w2 = _mm256_set1_ps(1.f / 36.f);
+  const __m256 omega = _mm256_set1_ps(params.omega);
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i lane_bits = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+  float** in = cells->speeds;
+  float** out = tmp_cells->speeds;
+  __m256 u_sum = _mm256_setzero_ps();
+
+  for (int span = obstacles->row_spans[jj]; span < obstacles->row_spans[jj + 1];
+       span++) {
+    const int end = obstacles->spans[2 * span + 1];
+    int ii = obstacles->spans[2 * span];
+
+    for (; ii + 8 <= end; ii += 8) {
+      const int index = row + ii;
+
+      /* pull densities from neighbouring cells */
+      const __m256 s0 = _mm256_loadu_ps(&in[0][index]);
+      const __m256 s1 = _mm256_loadu_ps(&in[1][index - 1]);
+      const __m256 s2 = _mm256_loadu_ps(&in[2][row_s + ii]);
+      const __m256 s3 = _mm256_loadu_ps(&in[3][index + 1]);
+      const __m256 s4 = _mm256_loadu_ps(&in[4][row_n + ii]);
+      const __m256 s5 = _mm256_loadu_ps(&in[5][row_s + ii - 1]);
+      const __m256 s6 = _mm256_loadu_ps(&in[6][row_s + ii + 1]);
+      const __m256 s7 = _mm256_loadu_ps(&in[7][row_n + ii + 1]);
+      const __m256 s8 = _mm256_loadu_ps(&in[8][row_n + ii - 1]);
+
+      /* all bits set in the lanes holding fluid cells */
+      const __m256i blocked = _mm256_and_si256(
+          _mm256_set1_epi32(BLOCKED_BITS(obstacles, ii, jj)), lane_bits);
+      const __m256 fluid =
+          _mm256_castsi256_ps(_mm256_cmpeq_epi32(blocked, zero));
+
+      /* local density and velocity */
+      const __m256 local_density = _mm256_add_ps(
+          _mm256_add_ps(_mm256_add_ps(_mm256_add_ps(s0, s1), s2),
+                        _mm256_add_ps(s3, s4)),
+          _mm256_add_ps(_mm256_add_ps(s5, s6), _mm256_add_ps(s7, s8)));
+      const __m256 inv_density = _mm256_div_ps(one, local_density);
+      const __m256 u_x = _mm256_mul_ps(
+          _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(s1, s5), s8),
+                        _mm256_add_ps(_mm256_add_ps(s3, s6), s7)),
+          inv_density);
+      const __m256 u_y = _mm256_mul_ps(
+          _mm256_sub_ps(_mm256_add_ps(_mm256_add_ps(s2, s5), s6),
+                        _mm256_add_ps(_mm256_add_ps(s4, s7), s8)),
+          inv_density);
+      const __m256 u_sq = _mm256_fmadd_ps(u_x, u_x, _mm256_mul_ps(u_y, u_y));
+      const __m256 u5 = _mm256_add_ps(u_x, u_y);
+      const __m256 u6 = _mm256_sub_ps(u_y, u_x);
+
+      /* equilibrium densities are d * (c + 3u + 4.5u^2), see
+      ** timestep_cells(); the u^2 terms are shared by opposite speeds */
+      const __m256 c = _mm256_fnmadd_ps(one_half, u_sq, one);
+      const __m256 d0 = _mm256_mul_ps(w0, local_density);
+      const __m256 d1 = _mm256_mul_ps(w1, local_density);
+      const __m256 d2 = _mm256_mul_ps(w2, local_density);
+      const __m256 cx = _mm256_fmadd_ps(four_half, _mm256_mul_ps(u_x, u_x), c);
+      const __m256 cy = _mm256_fmadd_ps(four_half, _mm256_mul_ps(u_y, u_y), c);
+      const __m256 c5 = _mm256_fmadd_ps(four_half, _mm256_mul_ps(u5, u5), c);
+      const __m256 c6 = _mm256_fmadd_ps(four_half, _mm256_mul_ps(u6, u6), c);
+      const __m256 e1 = _mm256_mul_ps(d1, _mm256_fmadd_ps(three, u_x, cx));
+      const __m256 e2 = _mm256_mul_ps(d1, _mm256_fmadd_ps(three, u_y, cy));
+      const __m256 e3 = _mm256_mul_ps(d1, _mm256_fnmadd_ps(three, u_x, cx));
+      const __m256 e4 = _mm256_mul_ps(d1, _mm256_fnmadd_ps(three, u_y, cy));
+      const __m256 e5 = _mm256_mul_ps(d2, _mm256_fmadd_ps(three, u5, c5));
+      const __m256 e6 = _mm256_mul_ps(d2, _mm256_fmadd_ps(three, u6, c6));
+      const __m256 e7 = _mm256_mul_ps(d2, _mm256_fnmadd_ps(three, u5, c5));
+      const __m256 e8 = _mm256_mul_ps(d2, _mm256_fnmadd_ps(three, u6, c6));
+
+      /* relax fluid cells, bounce back in obstacle cells */
+#define RELAX(kk, e, bounced)                                    \
+  _mm256_storeu_ps(                                              \
+      &out[kk][index],                                           \
+      _mm256_blendv_ps(                                          \
+          bounced,                                               \
+          _mm256_fmadd_ps(omega, _mm256_sub_ps(e, s##kk), s##kk), \
+          fluid))
+      RELAX(0, _mm256_mul_ps(d0, c), s0);
+      RELAX(1, e1, s3);
+      RELAX(2, e2, s4);
+      RELAX(3, e3, s1);
+      RELAX(4, e4, s2);
+      RELAX(5, e5, s7);
+      RELAX(6, e6, s8);
+      RELAX(7, e7, s5);
+      RELAX(8, e8, s6);
+#undef RELAX
+
+      u_sum = _mm256_add_ps(u_sum, _mm256_and_ps(fluid, _mm256_sqrt_ps(u_sq)));
+    }
+
+    timestep_cells(params, domain, cells, tmp_cells, obstacles, jj, ii, end,
+                   tot_u);
+  }
+
+  /* horizontal sum of the velocity norms */
+  __m128 sum = _mm_add_ps(_mm256_castps256_ps128(u_sum),
+                          _mm256_extractf128_ps(u_sum, 1));
+  sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+  sum = _mm_add_ss(sum, _mm_movehdup_ps(sum));
+  *tot_u += _mm_cvtss_f32(sum);
+
+  return EXIT_SUCCESS;
+}
+
+__attribute__((target("avx512f"))) int timestep_row_avx512(
+    const t_param params, const t_domain domain, t_speed* cells,
+    t_speed* tmp_cells, const t_obstacles* obstacles, int jj, t_accum* tot_u) {
+  const int row = jj * domain.width;
+  const int row_n = (jj + 1) * domain.width;
+  const int row_s = (jj - 1) * domain.width;
+  const __m512 one = _mm512_set1_ps(1.f);
+  const __m512 three = _mm512_set1_ps(3.f);
+  const __m512 four_half = _mm512_set1_ps(4.5f);
+  const __m512 one_half = _mm512_set1_ps(1.5f);
+  const __m512 w0 = _mm512_set1_ps(4.f / 9.f);
+  const __m512 w1 = _mm512_set1_ps(1.f / 9.f);
+  const __m512 w2 = _mm512_set1_ps(1.f / 36.f);
+  const __m512 omega = _mm512_set1_ps(params.omega);
+  float** in = cells->speeds;
+  float** out = tmp_cells->speeds;
+  __m512 u_sum = _mm512_setzero_ps();
+
+  for (int span = obstacles->row_spans[jj]; span < obstacles->row_spans[jj + 1];
+       span++) {
+    const int end = obstacles->spans[2 * span + 1];
+    int ii = obstacles->spans[2 * span];
+
+    for (; ii + 16 <= end; ii += 16) {
+      const int index = row + ii;
+
+      /* pull densities from neighbouring cells */
+      const __m512 s0 = _mm512_loadu_ps(&in[0][index]);
+      const __m512 s1 = _mm512_loadu_ps(&in[1][index - 1]);
+      const __m512 s2 = _mm512_loadu_ps(&in[2][row_s + ii]);
+      const __m512 s3 = _mm512_loadu_ps(&in[3][index + 1]);
+      const __m512 s4 = _mm512_loadu_ps(&in[4][row_n + ii]);
+      const __m512 s5 = _mm512_loadu_ps(&in[5][row_s + ii - 1]);
+      const __m512 s6 = _mm512_loadu_ps(&in[6][row_s + ii + 1]);
+      const __m512 s7 = _mm512_loadu_ps(&in[7][row_n + ii + 1]);
+      const __m512 s8 = _mm512_loadu_ps(&in[8][row_n + ii - 1]);
+
+      /* one bit set for each lane holding a fluid cell */
+      const __mmask16 fluid = (__mmask16)~BLOCKED_BITS(obstacles, ii, jj);
+
+      /* local density and velocity */
+      const __m512 local_density = _mm512_add_ps(
+          _mm512_add_ps(_mm512_add_ps(_mm512_add_ps(s0, s1), s2),
+                        _mm512_add_ps(s3, s4)),
+          _mm512_add_ps(_mm512_add_ps(s5, s6), _mm512_add_ps(s7, s8)));
+      const __m512 inv_density = _mm512_div_ps(one, local_density);
+      const __m512 u_x = _mm512_mul_ps(
+          _mm512_sub_ps(_mm512_add_ps(_mm512_add_ps(s1, s5), s8),
+                        _mm512_add_ps(_mm512_add_ps(s3, s6), s7)),
+          inv_density);
+      const __m512 u_y = _mm512_mul_ps(
+          _mm512_sub_ps(_mm512_add_ps(_mm512_add_ps(s2, s5), s6),
+                        _mm512_add_ps(_mm512_add_ps(s4, s7), s8)),
+          inv_density);
+      const __m512 u_sq = _mm512_fmadd_ps(u_x, u_x, _mm512_mul_ps(u_y, u_y));
+      const __m512 u5 = _mm512_add_ps(u_x, u_y);
+      const __m512 u6 = _mm512_sub_ps(u_y, u_x);
+
+      /* equilibrium densities, as in timestep_row_avx2() */
+      const __m512 c = _mm512_fnmadd_ps(one_half, u_sq, one);
+      const __m512 d0 = _mm512_mul_ps(w0, local_density);
+      const __m512 d1 = _mm512_mul_ps(w1, local_density);
+      const __m512 d2 = _mm512_mul_ps(w2, local_density);
+      const __m512 cx = _mm512_fmadd_ps(four_half, _mm512_mul_ps(u_x, u_x), c);
+      const __m512 cy = _mm512_fmadd_ps(four_half, _mm512_mul_ps(u_y, u_y), c);
+      const __m512 c5 = _mm512_fmadd_ps(four_half, _mm512_mul_ps(u5, u5), c);
+      const __m512 c6 = _mm512_fmadd_ps(four_half, _mm512_mul_ps(u6, u6), c);
+      const __m512 e1 = _mm512_mul_ps(d1, _mm512_fmadd_ps(three, u_x, cx));
+      const __m512 e2 = _mm512_mul_ps(d1, _mm512_fmadd_ps(three, u_y, cy));
+      const __m512 e3 = _mm512_mul_ps(d1, _mm512_fnmadd_ps(three, u_x, cx));
+      const __m512 e4 = _mm512_mul_ps(d1, _mm512_fnmadd_ps(three, u_y, cy));
+      const __m512 e5 = _mm512_mul_ps(d2, _mm512_fmadd_ps(three, u5, c5));
+      const __m512 e6 = _mm512_mul_ps(d2, _mm512_fmadd_ps(three, u6, c6));
+      const __m512 e7 = _mm512_mul_ps(d2, _mm512_fnmadd_ps(three, u5, c5));
+      const __m512 e8 = _mm512_mul_ps(d2, _mm512_fnmadd_ps(three, u6, c6));
+
+      /* relax fluid cells, bounce back in obstacle cells */
+#define RELAX(kk, e, bounced)                                   \
+  _mm512_storeu_ps(                                             \
+      &out[kk][index],                                          \
+      _mm512_mask_blend_ps(                                     \
+          fluid, bounced,                                       \
+          _mm512_fmadd_ps(omega, _mm512_sub_ps(e, s##kk), s##kk)))
+      RELAX(0, _mm512_mul_ps(d0, c), s0);
+      RELAX(1, e1, s3);
+      RELAX(2, e2, s4);
+      RELAX(3, e3, s1);
+      RELAX(4, e4, s2);
+      RELAX(5, e5, s7);
+      RELAX(6, e6, s8);
+      RELAX(7, e7, s5);
+      RELAX(8, e8, s6);
+#undef RELAX
+
+      u_sum = _mm512_mask_add_ps(u_sum, fluid, u_sum, _mm512_sqrt_ps(u_sq));
+    }
+
+    timestep_cells(params, domain, cells, tmp_cells, obstacles, jj, ii, end,
+                   tot_u);
+  }
+
+  *tot_u += _mm512_reduce_add_ps(u_sum);
+
+  return EXIT_SUCCESS;
+}
+#endif
+
+#ifdef FIXED_SIZES
+/* a copy of domain with the width a constant, which the compiler follows
+** into timestep_cells() as it inlines it, so the offsets of the rows
+** above and below fold into the addressing of every load */
+#define FIXED_ROW_BODY(nx)                                                 \
+  {                                                                        \
+    t_domain fixed = domain;                                               \
+                                                                           \
+    fixed.width = (nx) + 2;                                                \
+    return timestep_row(params, fixed, cells, tmp_cells, obstacles, jj,    \
+                        tot_u);                                            \
+  }
+
+FIXED_ROW_KERNEL(128) FIXED_ROW_BODY(128)
+FIXED_ROW_KERNEL(256) FIXED_ROW_BODY(256)
+FIXED_ROW_KERNEL(1024) FIXED_ROW_BODY(1024)
+#endif
+
+t_row_kernel select_row_kernel(const t_domain domain) {
+#ifdef SIMD_KERNELS
+  __builtin_cpu_init();
+
+  if (__builtin_cpu_supports("avx512f")) {
+    return timestep_row_avx512;
+  }
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+    return timestep_row_avx2;
+  }
+#endif
+#ifdef FIXED_SIZES
+  /* otherwise the generic kernel, for grids of any other size */
+  switch (domain.nx) {
+    case 128:
+      return timestep_row_128;
+    case 256:
+      return timestep_row_256;
+    case 1024:
+      return timestep_row_1024;
+  }
+#endif
+
+  return timestep_row;
+}
+
+#ifdef OFFLOAD
+int timestep_device(const t_param params, const t_domain domain,
+                    t_speed* cells, t_speed* tmp_cells,
+                    const t_obstacles* obstacles, int accel_row,
+                    t_accum* tot_u) {
+  t_accum u = 0; /* velocity norms of the owned rows */
+
+  /* the grid structs hold device pointers, so copying them in is enough.
+  ** Every cell is updated: skipping the obstacle cells away from the
+  ** fluid, as the spans do, would only unbalance the threads. */
+#pragma omp target teams distribute reduction(+ : u)                   \
+    map(to : cells[0 : 1], tmp_cells[0 : 1], obstacles[0 : 1])
+  for (int jj = 1; jj <= domain.ny; jj++) {
+    t_accum row_u = 0;
+
+#pragma omp parallel for reduction(+ : row_u)
+    for (int ii = 1; ii <= domain.nx; ii++) {
+      timestep_cells(params, domain, cells, tmp_cells, obstacles, jj, ii,
+                     ii + 1, &row_u);
+    }
+
+    u += row_u;
+
+    /* after the whole row, as in timestep() */
+    if (jj == accel_row)
+      accelerate_flow(params, domain, tmp_cells, obstacles, jj);
+  }
+
+  *tot_u += u;
+
+  return EXIT_SUCCESS;
+}
+
+int accelerate_device(const t_param params, const t_domain domain,
+                      t_speed* cells, const t_obstacles* obstacles, int jj) {
+  /* only needed before the first timestep, the kernel does the rest */
+#pragma omp target map(to : cells[0 : 1], obstacles[0 : 1])
+  accelerate_flow(params, domain, cells, obstacles, jj);
+
+  return EXIT_SUCCESS;
+}
+#endif
+
+void wrap_row(const t_domain domain, t_speed* cells, int jj) {
+  const int row = jj * domain.width;
+
+  for (int kk = 0; kk < NSPEEDS; ++kk) {
+    SPEED(cells, row, kk) = SPEED(cells, row + domain.nx, kk);
+    SPEED(cells, row + domain.nx + 1, kk) = SPEED(cells, row + 1, kk);
+  }
+}
+
+void SendRecv(const t_domain domain, t_speed* cells, MPI_Datatype rows,
+              int to, int from, int sendRow, int receiveRow, int id) {
+  const int width = domain.width;
+  MPI_Status status;
+
+  MPI_Sendrecv(&SPEED(cells, sendRow * width, 0), 1, rows, to, id,
+               &SPEED(cells, receiveRow * width, 0), 1, rows, from, id,
+               domain.comm, &status);
+}
+
+int halo_exchange_columns(const t_domain domain, t_speed* cells) {
+  /* the columns are sent straight out of the grid with the column
+  ** datatypes, starting from the first owned row, or the first halo row
+  ** recomputed locally with -DHALO_DEPTH */
+  const int row = (2 - HALO_ROWS) * domain.width;
+
+  MPI_Sendrecv(&SPEED(cells, row + 1, 0), 1, domain.west_column, domain.west,
+               3, &SPEED(cells, row + domain.nx + 1, 0), 1,
+               domain.west_column, domain.east, 3, domain.comm,
+               MPI_STATUS_IGNORE);
+  MPI_Sendrecv(&SPEED(cells, row + domain.nx, 0), 1, domain.east_column,
+               domain.east, 4, &SPEED(cells, row, 0), 1, domain.east_column,
+               domain.west, 4, domain.comm, MPI_STATUS_IGNORE);
+
+  return EXIT_SUCCESS;
+}
+
+int halo_exchange(const t_domain domain, t_speed* cells) {
+  /* a process with no neighbour in a direction sends to itself, which
+  ** fills in the periodic halos */
+  halo_exchange_columns(domain, cells);
+  halo_exchange_rows(domain, cells);
+
+  return EXIT_SUCCESS;
+}
+
+int halo_exchange_rows(const t_domain domain, t_speed* cells) {
+  /* whole rows, so the corners filled in already are passed on */
+  SendRecv(domain, cells, domain.south_rows, domain.south, domain.north, 1,
+           domain.ny + 1, 0);
+  SendRecv(domain, cells, domain.north_rows, domain.north, domain.south,
+           domain.ny - HALO_ROWS + 1, 1 - HALO_ROWS, 1);
+
+  return EXIT_SUCCESS;
+}
+
+#ifdef AA_PATTERN
+int halo_return(const t_domain domain, t_speed* cells) {
+  const int row = domain.width; /* the first owned row */
+
+  /* whole halo rows, so the corners go on to the halo columns of the
+  ** processes above and below, and from there to their owners */
+  SendRecv(domain, cells, domain.north_return, domain.north, domain.south,
+           domain.ny + 1, 1, 5);
+  SendRecv(domain, cells, domain.south_return, domain.south, domain.north, 0,
+           domain.ny, 6);
+
+  MPI_Sendrecv(&SPEED(cells, row + domain.nx + 1, 0), 1, domain.east_return,
+               domain.east, 7, &SPEED(cells, row + 1, 0), 1,
+               domain.east_return, domain.west, 7, domain.comm,
+               MPI_STATUS_IGNORE);
+  MPI_Sendrecv(&SPEED(cells, row, 0), 1, domain.west_return, domain.west, 8,
+               &SPEED(cells, row + domain.nx, 0), 1, domain.west_return,
+               domain.east, 8, domain.comm, MPI_STATUS_IGNORE);
+
+  return EXIT_SUCCESS;
+}
+#endif
+
+#ifdef OFFLOAD
+int halo_exchange_device(const t_domain domain, t_speed* host_cells,
+                         t_speed* cells) {
+#pragma omp target teams distribute parallel for map(to : cells[0 : 1])
+  for (int jj = 1; jj <= domain.ny; jj++) wrap_row(domain, cells, jj);
+
+#ifdef DEVICE_MPI
+  halo_exchange_rows(domain, cells);
+#else
+  /* only the boundary rows go through the host copy, a row of each plane
+  ** at a time */
+  const int width = domain.width;
+  const int top = domain.ny * width;
+
+  for (int kk = 0; kk < NSPEEDS; kk++) {
+#pragma omp target update from(host_cells->speeds[kk][width : width], \
+                               host_cells->speeds[kk][top : width])
+  }
+
+  halo_exchange_rows(domain, host_cells);
+
+  for (int kk = 0; kk < NSPEEDS; kk++) {
+#pragma omp target update to(host_cells->speeds[kk][0 : width], \
+                             host_cells->speeds[kk][top + width : width])
+  }
+#endif
+
+  return EXIT_SUCCESS;
+}
+#endif
+
+int halo_exchange_begin(const t_domain domain, t_speed* cells,
+                        MPI_Request* requests) {
+  const int width = domain.width;
+
+  /* the rows carry the corners, so the columns have to be in first */
+  halo_exchange_columns(domain, cells);
+
+  /* same pairing and tags as halo_exchange(): the bottom row goes
+  ** down with tag 0 and the top row goes up with tag 1. The boundary
+  ** rows are only read while the interior is updated, so they can be
+  ** sent from in place. */
+  MPI_Irecv(&SPEED(cells, (domain.ny + 1) * width, 0), 1, domain.south_rows,
+            domain.north, 0, domain.comm, &requests[0]);
+  MPI_Irecv(&SPEED(cells, 0, 0), 1, domain.north_rows, domain.south, 1,
+            domain.comm, &requests[1]);
+  MPI_Isend(&SPEED(cells, width, 0), 1, domain.south_rows, domain.south, 0,
+            domain.comm, &requests[2]);
+  MPI_Isend(&SPEED(cells, domain.ny * width, 0), 1, domain.north_rows,
+            domain.north, 1, domain.comm, &requests[3]);
+
+  return EXIT_SUCCESS;
+}
+
+int halo_exchange_end(const t_domain domain, MPI_Request* requests) {
+  MPI_Waitall(4, requests, MPI_STATUSES_IGNORE);
+
+  return EXIT_SUCCESS;
+}
+
+int halo_types(t_speed* cells, t_domain* domain) {
+  const int width = domain->width;
+  const int rows = domain->ny + 2 * (HALO_ROWS - 1); /* in a column */
+#ifdef THIN_HALO
+  /* only the speeds moving into each halo are pulled out of it */
+  const int to_north[3] = {2, 5, 6};
+  const int to_south[3] = {4, 7, 8};
+  const int to_east[3] = {1, 5, 8};
+  const int to_west[3] = {3, 6, 7};
+  const int count = 3;
+#else
+  const int* to_north = NULL;
+  const int* to_south = NULL;
+  const int* to_east = NULL;
+  const int* to_west = NULL;
+  const int count = NSPEEDS;
+#endif
+
+  block_type(cells, width, HALO_ROWS, width, to_north, count,
+             &domain->north_rows);
+  block_type(cells, width, HALO_ROWS, width, to_south, count,
+             &domain->south_rows);
+  block_type(cells, 1, rows, width, to_east, count, &domain->east_column);
+  block_type(cells, 1, rows, width, to_west, count, &domain->west_column);
+
+#ifdef AA_PATTERN
+  /* the speeds pushed into each halo, opposite to those pulled out of it */
+  const int into_north[3] = {4, 7, 8};
+  const int into_south[3] = {2, 5, 6};
+  const int into_east[3] = {3, 6, 7};
+  const int into_west[3] = {1, 5, 8};
+
+  block_type(cells, width, 1, width, into_north, 3, &domain->north_return);
+  block_type(cells, width, 1, width, into_south, 3, &domain->south_return);
+  block_type(cells, 1, rows, width, into_east, 3, &domain->east_return);
+  block_type(cells, 1, rows, width, into_west, 3, &domain->west_return);
+#endif
+
+  return EXIT_SUCCESS;
+}
+
+t_accum av_velocity(const t_param params, const t_domain domain,
+                    t_speed* cells, const t_obstacles* obstacles) {
+  t_accum tot_u; /* accumulated magnitudes of velocity for each cell */
+
+  /* initialise */
+  tot_u = 0;
+
+  /* loop over all non-blocked cells */
+#pragma omp parallel for schedule(static) reduction(+ : tot_u)
+  for (int jj = 1; jj <= domain.ny; jj++) {
+    for (int ii = 1; ii <= domain.nx; ii++) {
+      /* ignore occupied cells */
+      if (!BLOCKED(obstacles, ii, jj)) {
+        /* local density total */
+        t_real local_density = 0;
+
+        for (int kk = 0; kk < NSPEEDS; kk++) {
+          local_density += SPEED(cells, ii + jj * domain.width, kk);
+        }
+
+        /* x-component of velocity */
+        t_real u_x = (SPEED(cells, ii + jj * domain.width, 1) +
+                     SPEED(cells, ii + jj * domain.width, 5) +
+                     SPEED(cells, ii + jj * domain.width, 8) -
+                     (SPEED(cells, ii + jj * domain.width, 3) +
+                      SPEED(cells, ii + jj * domain.width, 6) +
+                      SPEED(cells, ii + jj * domain.width, 7))) /
+                    local_density;
+        /* compute y velocity component */
+        t_real u_y = (SPEED(cells, ii + jj * domain.width, 2) +
+                     SPEED(cells, ii + jj * domain.width, 5) +
+                     SPEED(cells, ii + jj * domain.width, 6) -
+                     (SPEED(cells, ii + jj * domain.width, 4) +
+                      SPEED(cells, ii + jj * domain.width, 7) +
+                      SPEED(cells, ii + jj * domain.width, 8))) /
+                    local_density;
+
+        /* accumulate the norm of x- and y- velocity components */
+        tot_u += sqrt((u_x * u_x) + (u_y * u_y));
+      }
+    }
+  }
+
+  /* the fluid cells were counted in initialise() */
+  return reduce_av_velocity(params, domain, tot_u);
+}
+
+t_accum reduce_av_velocity(const t_param params, const t_domain domain,
+                           t_accum tot_u) {
+  t_accum sum;
+
+#ifdef CONVERGE
+  MPI_Allreduce(&tot_u, &sum, 1, ACCUM_MPI, MPI_SUM, domain.comm);
+
+  return sum / (t_accum)params.fluid_cells;
+#else
+  MPI_Reduce(&tot_u, &sum, 1, ACCUM_MPI, MPI_SUM, 0, domain.comm);
+
+  /* elsewhere, this rank's share of the average */
+  if (domain.rank == 0) {
+    return sum / (t_accum)params.fluid_cells;
+  } else {
+    return tot_u / (t_accum)params.fluid_cells;
+  }
+#endif
+}
+
+int reduce_av_vels(const t_param params, const t_domain domain,
+                   t_accum* av_vels, int count) {
+#ifdef CONVERGE
+  MPI_Allreduce(MPI_IN_PLACE, av_vels, count, ACCUM_MPI, MPI_SUM,
+                domain.comm);
+
+  for (int tt = 0; tt < count; tt++) {
+    av_vels[tt] = av_vels[tt] / (t_accum)params.fluid_cells;
+  }
+#else
+  if (domain.rank == MASTER) {
+    MPI_Reduce(MPI_IN_PLACE, av_vels, count, ACCUM_MPI, MPI_SUM, MASTER,
+               domain.comm);
+
+    /* the same division as reduce_av_velocity(), so the results match */
+    for (int tt = 0; tt < count; tt++) {
+      av_vels[tt] = av_vels[tt] / (t_accum)params.fluid_cells;
+    }
+  } else {
+    MPI_Reduce(av_vels, NULL, count, ACCUM_MPI, MPI_SUM, MASTER, domain.comm);
+  }
+#endif
+
+  return EXIT_SUCCESS;
+}
+
+#ifdef CONVERGE
+int converged(t_accum* recent, int tt_start, int tt, const t_accum* av_vels,
+              int count) {
+  const int last = tt + count - 1;
+
+  for (int ii = 0; ii < count; ii++) {
+    recent[(tt + ii) % CONVERGE_WINDOW] = av_vels[ii];
+  }
+
+  if (count < 1 || last + 1 - CONVERGE_WINDOW < tt_start) return 0;
+
+  t_accum lo = recent[0], hi = recent[0];
+
+  for (int ii = 1; ii < CONVERGE_WINDOW; ii++) {
+    if (recent[ii] < lo) lo = recent[ii];
+    if (recent[ii] > hi) hi = recent[ii];
+  }
+
+  return hi - lo <= CONVERGE * fabs(recent[last % CONVERGE_WINDOW]);
+}
+#endif
+
+int domain_range(int rows, int rank, int ranks, int* domain_start,
+                 int* domain_size) {
+  /* split the rows into contiguous blocks, the first (rows % ranks)
+  ** ranks taking one extra row each */
+  const int base = rows / ranks;
+  const int extra = rows % ranks;
+
+  *domain_size = base + (rank < extra ? 1 : 0);
+  *domain_start = rank * base + (rank < extra ? rank : extra);
+
+  return EXIT_SUCCESS;
+}
+
+int balance_range(const int* costs, int rows, int ranks, int* starts) {
+  long total = 0;
+
+  for (int jj = 0; jj < rows; jj++) total += costs[jj];
+
+  /* block r ends at the first row where the running total reaches
+  ** (r + 1) / ranks of the whole, leaving a row for each later block */
+  long sum = 0;
+  int jj = 0;
+
+  starts[0] = 0;
+
+  for (int r = 1; r < ranks; r++) {
+    const long target = total * r / ranks;
+
+    while (jj < rows - (ranks - r) && (jj < starts[r - 1] + 1 || sum < target))
+      sum += costs[jj++];
+
+    starts[r] = jj;
+  }
+  starts[ranks] = rows;
+
+  return EXIT_SUCCESS;
+}
+
+int row_costs(MPI_Comm comm, const t_param params, const uint32_t* map,
+              int* costs) {
+  int rank;
+
+  MPI_Comm_rank(comm, &rank);
+
+  if (rank == MASTER) {
+    const int words = MAP_WORDS(params.nx);
+
+    for (int jj = 0; jj < params.ny; jj++) {
+      costs[jj] = FLUID_COST * params.nx;
+
+      for (int ii = 0; ii < params.nx; ii++) {
+        if ((map[jj * words + (ii >> 5)] >> (ii & 31)) & 1u)
+          costs[jj] -= FLUID_COST - OBSTACLE_COST;
+      }
+    }
+  }
+
+  MPI_Bcast(costs, params.ny, MPI_INT, MASTER, comm);
+
+  return EXIT_SUCCESS;
+}
+
+int decompose(MPI_Comm comm, const t_param params, const int* row_costs,
+              t_domain* domain) {
+  int periods[2] = {1, 1}; /* the grid wraps around in both directions */
+
+  MPI_Comm_size(comm, &domain->size);
+
+#ifdef DECOMP_2D
+  domain->dims[0] = 0;
+  domain->dims[1] = 0;
+  MPI_Dims_create(domain->size, 2, domain->dims);
+#else
+  domain->dims[0] = domain->size;
+  domain->dims[1] = 1;
+#endif
+
+  /* no reordering, so ranks in the grid match those in comm */
+  MPI_Cart_create(comm, 2, domain->dims, periods, 0, &domain->comm);
+  MPI_Comm_rank(domain->comm, &domain->rank);
+  MPI_Cart_coords(domain->comm, domain->rank, 2, domain->coords);
+  MPI_Cart_shift(domain->comm, 0, 1, &domain->south, &domain->north);
+  MPI_Cart_shift(domain->comm, 1, 1, &domain->west, &domain->east);
+
+  domain_range(params.nx, domain->coords[1], domain->dims[1],
+               &domain->x_start, &domain->nx);
+
+  /* every process keeps where each row of processes starts, for
+  ** gathering the grid in sync_grid() */
+  domain->row_starts = malloc(sizeof(int) * (domain->dims[0] + 1));
+
+  if (domain->row_starts == NULL)
+    die("cannot allocate memory for row_starts", __LINE__, __FILE__);
+
+  if (row_costs != NULL && domain->dims[0] <= params.ny) {
+    balance_range(row_costs, params.ny, domain->dims[0], domain->row_starts);
+  } else {
+    for (int r = 0; r <= domain->dims[0]; r++) {
+      int size;
+
+      domain_range(params.ny, r, domain->dims[0], &domain->row_starts[r],
+                   &size);
+    }
+  }
+
+  domain->y_start = domain->row_starts[domain->coords[0]];
+  domain->ny = domain->row_starts[domain->coords[0] + 1] - domain->y_start;
+
+  if (domain->nx < 1 || domain->ny < 1)
+    die("more processes than rows or columns in the grid", __LINE__,
+        __FILE__);
+
+  domain->width = domain->nx + 2;
+
+  return EXIT_SUCCESS;
+}
+
+int sync_grid(const t_param params, const t_domain domain, t_speed* cells,
+              t_speed* global_cells) {
+  MPI_Datatype owned; /* the cells this process owns, within its grid */
+
+  /* the cells are sent straight out of the grids and received straight
+  ** into place, so nothing is copied on either side */
+  block_type(cells, domain.nx, domain.ny, domain.width, NULL, NSPEEDS,
+             &owned);
+
+#ifdef DECOMP_2D
+  /* the tiles differ in width, so they don't fit a single receive
+  ** datatype, and MASTER receives each into place in turn */
+  if (domain.rank != MASTER) {
+    MPI_Send(&SPEED(cells, domain.width + 1, 0), 1, owned, MASTER, 2,
+             domain.comm);
+  } else {
+    for (int i = 0; i < domain.size; ++i) {
+      MPI_Datatype tile;
+      int coords[2];
+      int x_start, y_start;
+      int nx, ny;
+
+      MPI_Cart_coords(domain.comm, i, 2, coords);
+      y_start = domain.row_starts[coords[0]];
+      ny = domain.row_starts[coords[0] + 1] - y_start;
+      domain_range(params.nx, coords[1], domain.dims[1], &x_start, &nx);
+
+      block_type(global_cells, nx, ny, params.nx, NULL, NSPEEDS, &tile);
+
+      if (i == MASTER) {
+        MPI_Sendrecv(&SPEED(cells, domain.width + 1, 0), 1, owned, MASTER, 2,
+                     &SPEED(global_cells, x_start + y_start * params.nx, 0),
+                     1, tile, MASTER, 2, domain.comm, MPI_STATUS_IGNORE);
+      } else {
+        MPI_Recv(&SPEED(global_cells, x_start + y_start * params.nx, 0), 1,
+                 tile, i, 2, domain.comm, MPI_STATUS_IGNORE);
+      }
+      MPI_Type_free(&tile);
+    }
+  }
+#else
+  /* each process owns whole rows, so its cells are consecutive rows of
+  ** the whole grid, and process i in comm is row i of processes */
+  MPI_Datatype row = MPI_DATATYPE_NULL;
+  int* counts = NULL; /* no. of rows from each process */
+  int* displs = NULL; /* first row from each process */
+  t_real* recv = NULL;
+
+  if (domain.rank == MASTER) {
+    counts = malloc(sizeof(int) * domain.size);
+    displs = malloc(sizeof(int) * domain.size);
+
+    if (counts == NULL || displs == NULL)
+      die("cannot allocate memory for gather counts", __LINE__, __FILE__);
+
+    for (int i = 0; i < domain.size; ++i) {
+      displs[i] = domain.row_starts[i];
+      counts[i] = domain.row_starts[i + 1] - domain.row_starts[i];
+    }
+
+    block_type(global_cells, params.nx, 1, params.nx, NULL, NSPEEDS, &row);
+    recv = &SPEED(global_cells, 0, 0);
+  }
+
+  MPI_Gatherv(&SPEED(cells, domain.width + 1, 0), 1, owned, recv, counts,
+              displs, row, MASTER, domain.comm);
+
+  if (domain.rank == MASTER) MPI_Type_free(&row);
+  free(counts);
+  free(displs);
+#endif
+
+  MPI_Type_free(&owned);
+
+  return EXIT_SUCCESS;
+}
+
+int block_type(const t_speed* cells, int nx, int ny, int width,
+               const int* speeds, int nspeeds, MPI_Datatype* type) {
+  MPI_Datatype cell;         /* the speeds of one cell */
+  MPI_Datatype values;       /* the same, before resizing */
+  MPI_Aint offsets[NSPEEDS]; /* of the speeds from speed 0 of the cell */
+
+  /* one value from each plane, or from each field of the t_speed struct,
+  ** resized so the next cell starts one cell along */
+  for (int kk = 0; kk < nspeeds; kk++) {
+    const int speed = speeds == NULL ? kk : speeds[kk];
+
+    offsets[kk] = (char*)&SPEED(cells, 0, speed) - (char*)&SPEED(cells, 0, 0);
+  }
+
+  MPI_Type_create_hindexed_block(nspeeds, 1, offsets, REAL_MPI, &values);
+#ifdef SOA
+  MPI_Type_create_resized(values, 0, sizeof(t_real), &cell);
+#else
+  MPI_Type_create_resized(values, 0, sizeof(t_speed), &cell);
+#endif
+  MPI_Type_free(&values);
+
+  MPI_Type_vector(ny, nx, width, cell, type);
+  MPI_Type_commit(type);
+  MPI_Type_free(&cell);
+
+  return EXIT_SUCCESS;
+}
+
+int initialise(MPI_Comm comm, const char* paramfile, const char* obstaclefile,
+               const char* checkpointfile, t_map_cache* cache,
+               t_param* params, t_domain* domain, t_speed** cells_ptr,
+               t_speed** tmp_cells_ptr, t_obstacles** obstacles_ptr,
+               int** global_obstacles_ptr, t_accum** av_vels_ptr,
+               int* tt_start) {
+  uint32_t* map = NULL; /* obstacle bitmap of the whole grid, on MASTER */
+  int rank;
+
+  MPI_Comm_rank(comm, &rank);
+
+  read_params(comm, paramfile, params);
+
+  if (rank == MASTER && cache != NULL && cache->map != NULL &&
+      strcmp(cache->obstaclefile, obstaclefile) == 0 &&
+      cache->nx == params->nx && cache->ny == params->ny) {
+    /* the same obstacles as the last simulation of the ensemble */
+    map = cache->map;
+  } else if (rank == MASTER) {
+    map = malloc(sizeof(uint32_t) * MAP_WORDS(params->nx) * params->ny);
+
+    if (map == NULL)
+      die("cannot allocate memory for obstacle map", __LINE__, __FILE__);
+
+    read_obstacles(*params, obstaclefile, map);
+
+    if (cache != NULL) {
+      free(cache->map);
+      cache->map = map;
+      snprintf(cache->obstaclefile, NAME_LEN, "%s", obstaclefile);
+      cache->nx = params->nx;
+      cache->ny = params->ny;
+    }
+  }
+
+  /* calculate the part of the grid owned by this process */
+#ifdef BALANCE
+  int* costs = malloc(sizeof(int) * params->ny);
+
+  if (costs == NULL)
+    die("cannot allocate memory for costs", __LINE__, __FILE__);
+
+  row_costs(comm, *params, map, costs);
+  decompose(comm, *params, costs, domain);
+  free(costs);
+#else
+  decompose(comm, *params, NULL, domain);
+#endif
+
+  if (domain->ny < HALO_ROWS)
+    die("fewer rows on a process than HALO_DEPTH", __LINE__, __FILE__);
+
+  /* no. of cells this process stores, including its halos, and those
+  ** below row 0 */
+  const int width = domain->width;
+  const int local_cells = (domain->ny + 2 * HALO_ROWS) * width;
+  const int offset = (HALO_ROWS - 1) * width;
+
+  /*
+  ** Allocate memory.
+  **
+  ** Remember C is pass-by-value, so we need to
+  ** pass pointers into the initialise function.
+  **
+  ** NB we are allocating a 1D array, so that the
+  ** memory will be contiguous.  We still want to
+  ** index this memory as if it were a (row major
+  ** ordered) 2D array, however.  We will perform
+  ** some arithmetic using the row and column
+  ** coordinates, inside the square brackets, when
+  ** we want to access elements of this array.
+  **
+  ** Note also that we are using a structure to
+  ** hold an array of 'speeds'.  We will allocate
+  ** a 1D array of these structs, or, when built
+  ** with -DSOA, a single struct holding one 1D
+  ** array per speed (see alloc_grid()).
+  */
+
+  /* main grid */
+  *cells_ptr = alloc_grid(local_cells, offset);
+
+  if (*cells_ptr == NULL)
+    die("cannot allocate memory for cells", __LINE__, __FILE__);
+
+#ifdef AA_PATTERN
+  /* the one grid is updated in place */
+  *tmp_cells_ptr = NULL;
+#else
+  /* 'helper' grid, used as scratch space */
+  *tmp_cells_ptr = alloc_grid(local_cells, offset);
+
+  if (*tmp_cells_ptr == NULL)
+    die("cannot allocate memory for tmp_cells", __LINE__, __FILE__);
+#endif
+
+  /* the map of obstacles, cleared; the padding word at the end of each
+  ** row lets BLOCKED_BITS() read past the last cell */
+  t_obstacles* obstacles = malloc(sizeof(t_obstacles));
+
+  if (obstacles == NULL)
+    die("cannot allocate memory for obstacles", __LINE__, __FILE__);
+
+  obstacles->row_words = (width + 31) / 32 + 1;
+  const size_t bits_size =
+      sizeof(uint32_t) * obstacles->row_words * (domain->ny + 2 * HALO_ROWS);
+
+  obstacles->bits = alloc_lattice(bits_size);
+
+  if (obstacles->bits == NULL)
+    die("cannot allocate column memory for obstacles", __LINE__, __FILE__);
+
+  memset(obstacles->bits, 0, bits_size);
+
+  obstacles->bits += (HALO_ROWS - 1) * obstacles->row_words;
+
+  *obstacles_ptr = obstacles;
+
+  /* MASTER keeps the whole map for writing out the final state */
+  *global_obstacles_ptr = NULL;
+
+  if (domain->rank == MASTER) {
+    *global_obstacles_ptr = malloc(sizeof(int) * (params->ny * params->nx));
+
+    if (*global_obstacles_ptr == NULL)
+      die("cannot allocate memory for global_obstacles", __LINE__, __FILE__);
+  }
+
+  /* initialise densities */
+  t_real w0 = params->density * (t_real)4 / 9;
+  t_real w1 = params->density / 9;
+  t_real w2 = params->density / 36;
+
+  /* both grids are written here by the threads which will update the
+  ** same rows in timestep(), so with OpenMP their pages are first
+  ** touched, and so placed, on the right NUMA node */
+#pragma omp parallel for schedule(static)
+  for (int jj = 1 - HALO_ROWS; jj <= domain->ny + HALO_ROWS; jj++) {
+    for (int ii = 0; ii < width; ii++) {
+      for (int grid = 0; grid < 2; grid++) {
+        t_speed* init = grid ? *tmp_cells_ptr : *cells_ptr;
+
+        if (init == NULL) continue;
+
+        /* centre */
+        SPEED(init, ii + jj * width, 0) = w0;
+        /* axis directions */
+        SPEED(init, ii + jj * width, 1) = w1;
+        SPEED(init, ii + jj * width, 2) = w1;
+        SPEED(init, ii + jj * width, 3) = w1;
+        SPEED(init, ii + jj * width, 4) = w1;
+        /* diagonals */
+        SPEED(init, ii + jj * width, 5) = w2;
+        SPEED(init, ii + jj * width, 6) = w2;
+        SPEED(init, ii + jj * width, 7) = w2;
+        SPEED(init, ii + jj * width, 8) = w2;
+      }
+    }
+  }
+
+  /* the rows of the obstacle map covering the local grid */
+  const int words = MAP_WORDS(params->nx);
+  uint32_t* rows =
+      malloc(sizeof(uint32_t) * words * (domain->ny + 2 * HALO_ROWS));
+
+  if (rows == NULL)
+    die("cannot allocate memory for obstacle rows", __LINE__, __FILE__);
+
+  scatter_obstacles(*params, *domain, map, rows);
+
+  /* the local map includes its halos, for finding the obstacle cells next
+  ** to fluid ones, wrapped around the grid */
+  for (int jj = 1 - HALO_ROWS; jj <= domain->ny + HALO_ROWS; jj++) {
+    const uint32_t* row = rows + (jj + HALO_ROWS - 1) * words;
+
+    for (int ii = 0; ii <= domain->nx + 1; ii++) {
+      const int xx = (domain->x_start + ii - 1 + params->nx) % params->nx;
+
+      if ((row[xx >> 5] >> (xx & 31)) & 1u)
+        obstacles->bits[jj * obstacles->row_words + (ii >> 5)] |=
+            1u << (ii & 31);
+    }
+  }
+
+  free(rows);
+
+  if (domain->rank == MASTER) {
+    for (int jj = 0; jj < params->ny; jj++) {
+      for (int ii = 0; ii < params->nx; ii++) {
+        (*global_obstacles_ptr)[ii + jj * params->nx] =
+            (map[jj * words + (ii >> 5)] >> (ii & 31)) & 1u;
+      }
+    }
+  }
+
+  if (cache == NULL) free(map);
+
+  /* the fluid cells never change, so they are only counted once */
+  int fluid_cells = 0;
+
+  for (int jj = 1; jj <= domain->ny; jj++) {
+    for (int ii = 1; ii <= domain->nx; ii++) {
+      if (!BLOCKED(obstacles, ii, jj)) ++fluid_cells;
+    }
+  }
+
+  MPI_Allreduce(&fluid_cells, &params->fluid_cells, 1, MPI_INT, MPI_SUM,
+                domain->comm);
+
+  find_spans(*domain, obstacles);
+
+  /* the datatypes for the halos; every grid of this size has the same
+  ** layout */
+  halo_types(*cells_ptr, domain);
+
+  /*
+  ** allocate space to hold a record of the avarage velocities computed
+  ** at each timestep
+  */
+#if defined(STREAM_AV_VELS) && defined(REDUCE_EVERY)
+  /* only the sums since the last reduction, which are streamed out */
+  *av_vels_ptr = (t_accum*)malloc(
+      sizeof(t_accum) * (REDUCE_EVERY > 0 ? REDUCE_EVERY : params->maxIters));
+#elif defined(STREAM_AV_VELS)
+  /* none, each one is streamed out as soon as it is reduced */
+  *av_vels_ptr = NULL;
+#else
+  *av_vels_ptr = (t_accum*)malloc(sizeof(t_accum) * params->maxIters);
+#endif
+
+  /* carry on from a checkpoint, or start from scratch */
+  *tt_start = 0;
+
+  if (checkpointfile != NULL) {
+    read_checkpoint(checkpointfile, *params, *domain, *cells_ptr, *av_vels_ptr,
+                    tt_start);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+int read_params(MPI_Comm comm, const char* paramfile, t_param* params) {
+  char message[1024]; /* message buffer */
+  FILE* fp;           /* file pointer */
+  int retval;         /* to hold return value for checking */
+  int rank;
+
+  MPI_Comm_rank(comm, &rank);
+
+  if (rank == MASTER) {
+    /* open the parameter file */
+    fp = fopen(paramfile, "r");
+
+    if (fp == NULL) {
+      sprintf(message, "could not open input parameter file: %s", paramfile);
+      die(message, __LINE__, __FILE__);
+    }
+
+    /* read in the parameter values */
+    retval = fscanf(fp, "%d\n", &(params->nx));
+
+    if (retval != 1) die("could not read param file: nx", __LINE__, __FILE__);
+
+    retval = fscanf(fp, "%d\n", &(params->ny));
+
+    if (retval != 1) die("could not read param file: ny", __LINE__, __FILE__);
+
+    retval = fscanf(fp, "%d\n", &(params->maxIters));
+
+    if (retval != 1)
+      die("could not read param file: maxIters", __LINE__, __FILE__);
+
+    retval = fscanf(fp, "%d\n", &(params->reynolds_dim));
+
+    if (retval != 1)
+      die("could not read param file: reynolds_dim", __LINE__, __FILE__);
+
+    retval = fscanf(fp, REAL_SCAN "\n", &(params->density));
+
+    if (retval != 1)
+      die("could not read param file: density", __LINE__, __FILE__);
+
+    retval = fscanf(fp, REAL_SCAN "\n", &(params->accel));
+
+    if (retval != 1)
+      die("could not read param file: accel", __LINE__, __FILE__);
+
+    retval = fscanf(fp, REAL_SCAN "\n", &(params->omega));
+
+    if (retval != 1)
+      die("could not read param file: omega", __LINE__, __FILE__);
+
+    /* and close up the file */
+    fclose(fp);
+  }
+
+  /* every process runs the same executable, so the struct is the same */
+  MPI_Bcast(params, sizeof(t_param), MPI_BYTE, MASTER, comm);
+
+  return EXIT_SUCCESS;
+}
+
+int read_obstacles(const t_param params, const char* obstaclefile,
+                   uint32_t* map) {
+  char message[1024]; /* message buffer */
+  char magic[sizeof(OBSTACLE_MAGIC)];
+  const int words = MAP_WORDS(params.nx);
+  FILE* fp;    /* file pointer */
+  int xx, yy;  /* generic array indices */
+  int blocked; /* indicates whether a cell is blocked by an obstacle */
+  int retval;  /* to hold return value for checking */
+
+  fp = fopen(obstaclefile, "rb");
+
+  if (fp == NULL) {
+    sprintf(message, "could not open input obstacles file: %s", obstaclefile);
+    die(message, __LINE__, __FILE__);
+  }
+
+  if (fread(magic, 1, sizeof(magic), fp) == sizeof(magic) &&
+      memcmp(magic, OBSTACLE_MAGIC, sizeof(magic)) == 0) {
+    int32_t dims[2];
+
+    if (fread(dims, sizeof(int32_t), 2, fp) != 2)
+      die("could not read obstacle file header", __LINE__, __FILE__);
+
+    if (dims[0] != params.nx || dims[1] != params.ny)
+      die("obstacle grid size does not match the param file", __LINE__,
+          __FILE__);
+
+    if (fread(map, sizeof(uint32_t), (size_t)words * params.ny, fp) !=
+        (size_t)words * params.ny)
+      die("obstacle file too short", __LINE__, __FILE__);
+
+    fclose(fp);
+
+    return EXIT_SUCCESS;
+  }
+
+  /* a text file: start again from the top */
+  rewind(fp);
+  memset(map, 0, sizeof(uint32_t) * words * params.ny);
+
+  /* read-in the blocked cells list */
+  while ((retval = fscanf(fp, "%d %d %d\n", &xx, &yy, &blocked)) != EOF) {
+    /* some checks */
+    if (retval != 3)
+      die("expected 3 values per line in obstacle file", __LINE__, __FILE__);
+
+    if (xx < 0 || xx > params.nx - 1)
+      die("obstacle x-coord out of range", __LINE__, __FILE__);
+
+    if (yy < 0 || yy > params.ny - 1)
+      die("obstacle y-coord out of range", __LINE__, __FILE__);
+
+    if (blocked != 1)
+      die("obstacle blocked value should be 1", __LINE__, __FILE__);
+
+    map[yy * words + (xx >> 5)] |= 1u << (xx & 31);
+  }
+
+  /* and close the file */
+  fclose(fp);
+
+  return EXIT_SUCCESS;
+}
+
+int scatter_obstacles(const t_param params, const t_domain domain,
+                      const uint32_t* map, uint32_t* rows) {
+  const int words = MAP_WORDS(params.nx);
+  const int count = domain.ny + 2 * HALO_ROWS; /* rows per process */
+
+  if (domain.rank != MASTER) {
+    MPI_Recv(rows, count * words, MPI_UINT32_T, MASTER, 0, domain.comm,
+             MPI_STATUS_IGNORE);
+
+    return EXIT_SUCCESS;
+  }
+
+  int* displs = malloc(sizeof(int) * (params.ny + 2 * HALO_ROWS));
+
+  if (displs == NULL)
+    die("cannot allocate memory for obstacle rows", __LINE__, __FILE__);
+
+  for (int rank = 0; rank < domain.size; rank++) {
+    int coords[2];
+
+    MPI_Cart_coords(domain.comm, rank, 2, coords);
+
+    /* the processes in a row of the decomposition need the same rows */
+    const int y_start = domain.row_starts[coords[0]];
+    const int ny = domain.row_starts[coords[0] + 1] - y_start;
+
+    for (int jj = 0; jj < ny + 2 * HALO_ROWS; jj++) {
+      const int yy = (y_start - HALO_ROWS + jj + 2 * params.ny) % params.ny;
+
+      displs[jj] = yy * words;
+    }
+
+    if (rank == MASTER) {
+      for (int jj = 0; jj < count; jj++)
+        memcpy(rows + jj * words, map + displs[jj], sizeof(uint32_t) * words);
+    } else {
+      MPI_Datatype tile;
+
+      MPI_Type_create_indexed_block(ny + 2 * HALO_ROWS, words, displs,
+                                    MPI_UINT32_T, &tile);
+      MPI_Type_commit(&tile);
+      MPI_Send(map, 1, tile, rank, 0, domain.comm);
+      MPI_Type_free(&tile);
+    }
+  }
+
+  free(displs);
+
+  return EXIT_SUCCESS;
+}
+
+int find_spans(const t_domain domain, t_obstacles* obstacles) {
+  int nspans = 0;
+
+  obstacles->row_spans = malloc(sizeof(int) * (domain.ny + 2 * HALO_ROWS));
+
+  if (obstacles->row_spans == NULL)
+    die("cannot allocate memory for row_spans", __LINE__, __FILE__);
+
+  obstacles->row_spans += HALO_ROWS - 1;
+
+  /* count the spans first, then fill them in */
+  obstacles->spans = NULL;
+
+  for (int pass = 0; pass < 2; pass++) {
+    nspans = 0;
+
+    for (int jj = 2 - HALO_ROWS; jj <= domain.ny + HALO_ROWS - 1; jj++) {
+      int start = -1; /* first column of the current span */
+
+      obstacles->row_spans[jj] = nspans;
+
+      for (int ii = 1; ii <= domain.nx + 1; ii++) {
+        /* a cell needs updating if it or any neighbour is fluid */
+        int active = 0;
+
+        if (ii <= domain.nx) {
+          for (int y = jj - 1; y <= jj + 1; y++) {
+            for (int x = ii - 1; x <= ii + 1; x++) {
+              if (!BLOCKED(obstacles, x, y)) active = 1;
+            }
+          }
+        }
+
+        if (active && start < 0) {
+          start = ii;
+        } else if (!active && start >= 0) {
+          if (pass == 1) {
+            obstacles->spans[2 * nspans] = start;
+            obstacles->spans[2 * nspans + 1] = ii;
+          }
+          ++nspans;
+          start = -1;
+        }
+      }
+    }
+
+    if (pass == 0) {
+      obstacles->spans = malloc(sizeof(int) * 2 * (nspans > 0 ? nspans : 1));
+
+      if (obstacles->spans == NULL)
+        die("cannot allocate memory for spans", __LINE__, __FILE__);
+    }
+  }
+
+  obstacles->row_spans[1 - HALO_ROWS] = 0;
+  obstacles->row_spans[domain.ny + HALO_ROWS] = nspans;
+
+  return EXIT_SUCCESS;
+}
+
+t_speed* alloc_grid(int ncells, int offset) {
+#ifdef SOA
+  t_speed* cells = malloc(sizeof(t_speed));
+  if (cells == NULL) return NULL;
+
+  /* pad each plane so that every one starts on an aligned boundary */
+  const size_t align = ALIGNMENT / sizeof(t_real);
+  const size_t plane = ((ncells + align - 1) / align) * align;
+  t_real* block = alloc_lattice(sizeof(t_real) * NSPEEDS * plane);
+
+  if (block == NULL) {
+    free(cells);
+    return NULL;
+  }
+
+  for (int kk = 0; kk < NSPEEDS; kk++) {
+    cells->speeds[kk] = block + kk * plane + offset;
+  }
+
+  return cells;
+#else
+  t_speed* cells = alloc_lattice(sizeof(t_speed) * ncells);
+
+  return cells == NULL ? NULL : cells + offset;
+#endif
+}
+
+void free_grid(t_speed* cells, int offset) {
+  if (cells == NULL) return;
+#ifdef SOA
+  /* the planes share a single allocation, starting at plane 0 */
+  free_lattice(cells->speeds[0] - offset);
+  free(cells);
+#else
+  free_lattice(cells - offset);
+#endif
+}
+
+void* alloc_lattice(size_t size) {
+  /* the length of the mapping, or 0 if malloced, is kept in the first
+  ** ALIGNMENT bytes, before the block itself */
+  size_t length = size + ALIGNMENT;
+  void* base = NULL;
+
+#ifdef __linux__
+  if (length >= HUGE_PAGE) {
+    length = (length + HUGE_PAGE - 1) / HUGE_PAGE * HUGE_PAGE;
+    base = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+    if (base == MAP_FAILED) {
+      base = mmap(NULL, length, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+      if (base == MAP_FAILED) return NULL;
+
+      madvise(base, length, MADV_HUGEPAGE);
+    }
+
+    /* nothing is touched yet, so the pages go where initialise() first
+    ** writes them, by the threads updating them; failing that, e.g. on
+    ** a kernel without NUMA, the default policy is left as it is */
+    syscall(SYS_mbind, base, length, MPOL_LOCAL, NULL, 0, 0);
+  }
+#endif
+
+  if (base == NULL) {
+    if (posix_memalign(&base, ALIGNMENT, length) != 0) return NULL;
+
+    length = 0;
+  }
+
+  *(size_t*)base = length;
+
+  return (char*)base + ALIGNMENT;
+}
+
+void free_lattice(void* block) {
+  if (block == NULL) return;
+
+  void* base = (char*)block - ALIGNMENT;
+  const size_t length = *(size_t*)base;
+
+#ifdef __linux__
+  if (length > 0) {
+    munmap(base, length);
+    return;
+  }
+#endif
+
+  free(base);
+}
+
+#ifdef OFFLOAD
+t_speed* device_grid(t_speed* cells) {
+  t_speed* dev_cells = malloc(sizeof(t_speed));
+  /* the planes share one allocation, which keeps its layout on the
+  ** device, so the halo datatypes work for either copy */
+  t_real* block = cells->speeds[0];
+  const size_t size = NSPEEDS * (cells->speeds[1] - cells->speeds[0]);
+
+  if (dev_cells == NULL)
+    die("cannot allocate memory for device grid", __LINE__, __FILE__);
+
+#pragma omp target enter data map(to : block[0 : size])
+#pragma omp target data use_device_ptr(block)
+  {
+    for (int kk = 0; kk < NSPEEDS; kk++) {
+      dev_cells->speeds[kk] = block + (cells->speeds[kk] - cells->speeds[0]);
+    }
+  }
+
+  return dev_cells;
+}
+
+void free_device_grid(t_speed* dev_cells, t_speed* cells, int copy) {
+  const size_t size = NSPEEDS * (cells->speeds[1] - cells->speeds[0]);
+
+  if (copy) {
+#pragma omp target exit data map(from : cells->speeds[0][0 : size])
+  } else {
+#pragma omp target exit data map(delete : cells->speeds[0][0 : size])
+  }
+
+  free(dev_cells);
+}
+
+int update_host_grid(t_speed* cells) {
+  const size_t size = NSPEEDS * (cells->speeds[1] - cells->speeds[0]);
+
+#pragma omp target update from(cells->speeds[0][0 : size])
+
+  return EXIT_SUCCESS;
+}
+
+t_obstacles* device_obstacles(const t_obstacles* obstacles, int rows) {
+  t_obstacles* dev_obstacles = malloc(sizeof(t_obstacles));
+  uint32_t* bits = obstacles->bits;
+  const size_t size = (size_t)rows * obstacles->row_words;
+
+  if (dev_obstacles == NULL)
+    die("cannot allocate memory for device obstacles", __LINE__, __FILE__);
+
+#pragma omp target enter data map(to : bits[0 : size])
+#pragma omp target data use_device_ptr(bits)
+  {
+    dev_obstacles->bits = bits;
+  }
+  dev_obstacles->row_words = obstacles->row_words;
+  dev_obstacles->spans = NULL;
+  dev_obstacles->row_spans = NULL;
+
+  return dev_obstacles;
+}
+
+void free_device_obstacles(t_obstacles* dev_obstacles,
+                           const t_obstacles* obstacles, int rows) {
+  const size_t size = (size_t)rows * obstacles->row_words;
+
+#pragma omp target exit data map(delete : obstacles->bits[0 : size])
+
+  free(dev_obstacles);
+}
+#endif
+
+int finalise(const t_param* params, t_domain* domain, t_speed** cells_ptr,
+             t_speed** tmp_cells_ptr, t_obstacles** obstacles_ptr,
+             t_speed** global_cells_ptr, int** global_obstacles_ptr,
+             t_accum** av_vels_ptr) {
+  /*
+  ** free up allocated memory
+  */
+  free_grid(*cells_ptr, (HALO_ROWS - 1) * domain->width);
+  *cells_ptr = NULL;
+
+  free_grid(*tmp_cells_ptr, (HALO_ROWS - 1) * domain->width);
+  *tmp_cells_ptr = NULL;
+
+  free_lattice((*obstacles_ptr)->bits -
+               (HALO_ROWS - 1) * (*obstacles_ptr)->row_words);
+  free((*obstacles_ptr)->spans);
+  free((*obstacles_ptr)->row_spans - (HALO_ROWS - 1));
+  free(*obstacles_ptr);
+  *obstacles_ptr = NULL;
+
+  free_grid(*global_cells_ptr, 0);
+  *global_cells_ptr = NULL;
+
+  free(*global_obstacles_ptr);
+  *global_obstacles_ptr = NULL;
+
+  free(*av_vels_ptr);
+  *av_vels_ptr = NULL;
+
+  MPI_Type_free(&domain->north_rows);
+  MPI_Type_free(&domain->south_rows);
+  MPI_Type_free(&domain->east_column);
+  MPI_Type_free(&domain->west_column);
+#ifdef AA_PATTERN
+  MPI_Type_free(&domain->north_return);
+  MPI_Type_free(&domain->south_return);
+  MPI_Type_free(&domain->east_return);
+  MPI_Type_free(&domain->west_return);
+#endif
+  MPI_Comm_free(&domain->comm);
+  free(domain->row_starts);
+  domain->row_starts = NULL;
+
+  return EXIT_SUCCESS;
+}
+
+t_accum calc_reynolds(const t_param params, const t_domain domain,
+                      t_speed* cells, const t_obstacles* obstacles) {
+  const t_real viscosity = (t_real)1 / 6 * (2 / params.omega - 1);
+
+  return av_velocity(params, domain, cells, obstacles) *
+         params.reynolds_dim / viscosity;
+}
+
+t_accum total_density(const t_param params, const t_domain domain,
+                      t_speed* cells) {
+  t_accum total = 0; /* accumulator */
+
+  for (int jj = 1; jj <= domain.ny; jj++) {
+    for (int ii = 1; ii <= domain.nx; ii++) {
+      for (int kk = 0; kk < NSPEEDS; kk++) {
+        total += SPEED(cells, ii + jj * domain.width, kk);
+      }
+    }
+  }
+
+  return total;
+}
+
+int cell_state(const t_param params, t_speed* cells, int index, int blocked,
+               t_real* state) {
+  const t_real c_sq = (t_real)1 / 3; /* sq. of speed of sound */
+  t_real local_density;              /* per grid cell sum of densities */
+  t_real pressure;                   /* fluid pressure in grid cell */
+  t_real u_x;                        /* x-component of velocity in grid cell */
+  t_real u_y;                        /* y-component of velocity in grid cell */
+  t_real u; /* norm--root of summed squares--of u_x and u_y */
+
+  /* an occupied cell */
+  if (blocked) {
+    u_x = u_y = u = 0;
+    pressure = params.density * c_sq;
+  } /* no obstacle */ else {
+    local_density = 0;
+
+    for (int kk = 0; kk < NSPEEDS; kk++) {
+      local_density += SPEED(cells, index, kk);
+    }
+
+    /* compute x velocity component */
+    u_x = (SPEED(cells, index, 1) + SPEED(cells, index, 5) +
+           SPEED(cells, index, 8) -
+           (SPEED(cells, index, 3) + SPEED(cells, index, 6) +
+            SPEED(cells, index, 7))) /
+          local_density;
+    /* compute y velocity component */
+    u_y = (SPEED(cells, index, 2) + SPEED(cells, index, 5) +
+           SPEED(cells, index, 6) -
+           (SPEED(cells, index, 4) + SPEED(cells, index, 7) +
+            SPEED(cells, index, 8))) /
+          local_density;
+    /* compute norm of velocity */
+    u = sqrt((u_x * u_x) + (u_y * u_y));
+    /* compute pressure */
+    pressure = local_density * c_sq;
+  }
+
+  state[0] = u_x;
+  state[1] = u_y;
+  state[2] = u;
+  state[3] = pressure;
+
+  return EXIT_SUCCESS;
+}
+
+int write_values(const t_param params, t_speed* cells, int* obstacles,
+                 t_accum* av_vels) {
+  FILE* fp;        /* file pointer */
+  t_real state[4]; /* u_x, u_y, u and pressure in grid cell */
+
+  fp = fopen(FINALSTATEFILE, "w");
+
+  if (fp == NULL) {
+    die("could not open file output file", __LINE__, __FILE__);
+  }
+
+  for (int jj = 0; jj < params.ny; jj++) {
+    for (int ii = 0; ii < params.nx; ii++) {
+      const int blocked = obstacles[ii + jj * params.nx];
+
+      cell_state(params, cells, ii + jj * params.nx, blocked, state);
+
+      /* write to file */
+      fprintf(fp, "%d %d %.12E %.12E %.12E %.12E %d\n", ii, jj, state[0],
+              state[1], state[2], state[3], blocked);
+    }
+  }
+
+  fclose(fp);
+
+#ifdef STREAM_AV_VELS
+  /* written as the run went */
+  return EXIT_SUCCESS;
+#else
+  return write_av_vels(params, av_vels);
+#endif
+}
+
+int write_av_vels(const t_param params, t_accum* av_vels) {
+  FILE* fp; /* file pointer */
+
+  fp = fopen(AVVELSFILE, "w");
+
+  if (fp == NULL) {
+    die("could not open file output file", __LINE__, __FILE__);
+  }
+
+  for (int ii = 0; ii < params.maxIters; ii++) {
+    fprintf(fp, "%d:\t%.12E\n", ii, av_vels[ii]);
   }
-  finalise(&params, &cells, &tmp_cells, &obstacles, &av_vels);
+
+  fclose(fp);
 
   return EXIT_SUCCESS;
 }
 
-int accelerate_flow(const t_param params, t_speed* cells, int* obstacles) {
-  /* compute weighting factors */
-  float w1 = params.density * params.accel / 9.f;
-  float w2 = params.density * params.accel / 36.f;
+#ifdef STREAM_AV_VELS
+int open_av_stream(const t_domain domain, int tt_start, t_av_stream* stream) {
+  stream->fd = -1;
+  stream->offset = 0;
+  stream->chunks[0] = stream->chunks[1] = NULL;
+  stream->filling = 0;
+  stream->lines = 0;
+  stream->length = 0;
+  stream->pending = 0;
 
-  /* modify the 2nd row of the grid */
-  int jj = params.ny - 2;
+  if (domain.rank != MASTER) return EXIT_SUCCESS;
 
-  for (int ii = 0; ii < params.nx; ii++) {
-    /* if the cell is not occupied and
-    ** we don't send a negative density */
-    if (!obstacles[ii + jj * params.nx] &&
-        (cells[ii + jj * params.nx].speeds[3] - w1) > 0.f &&
-        (cells[ii + jj * params.nx].speeds[6] - w2) > 0.f &&
-        (cells[ii + jj * params.nx].speeds[7] - w2) > 0.f) {
-      /* increase 'east-side' densities */
-      cells[ii + jj * params.nx].speeds[1] += w1;
-      cells[ii + jj * params.nx].speeds[5] += w2;
-      cells[ii + jj * params.nx].speeds[8] += w2;
-      /* decrease 'west-side' densities */
-      cells[ii + jj * params.nx].speeds[3] -= w1;
-      cells[ii + jj * params.nx].speeds[6] -= w2;
-      cells[ii + jj * params.nx].speeds[7] -= w2;
-    }
-  }
+  /* after a restart, keep the lines of the timesteps before tt_start,
+  ** which were all written out before the checkpoint */
+  if (tt_start > 0) {
+    FILE* fp = fopen(AVVELSFILE, "r");
+    char line[AV_VELS_LINE];
 
-  return EXIT_SUCCESS;
-}
+    if (fp == NULL) die("could not open file output file", __LINE__, __FILE__);
 
-int propagate(int ii, int jj, const t_param params, t_speed* cells,
-              t_speed* tmp_cells) {
-  /* determine indices of axis-direction neighbours
-  ** respecting periodic boundary conditions (wrap around) */
-  int y_n = (jj + 1) % params.ny;
-  int x_e = (ii + 1) % params.nx;
-  int y_s = (jj == 0) ? (jj + params.ny - 1) : (jj - 1);
-  int x_w = (ii == 0) ? (ii + params.nx - 1) : (ii - 1);
-  /* propagate densities from neighbouring cells, following
-  ** appropriate directions of travel and writing into
-  ** scratch space grid */
-  tmp_cells[ii + jj * params.nx].speeds[0] =
-      cells[ii + jj * params.nx].speeds[0]; /* central cell, no movement */
-  tmp_cells[ii + jj * params.nx].speeds[1] =
-      cells[x_w + jj * params.nx].speeds[1]; /* east */
-  tmp_cells[ii + jj * params.nx].speeds[2] =
-      cells[ii + y_s * params.nx].speeds[2]; /* north */
-  tmp_cells[ii + jj * params.nx].speeds[3] =
-      cells[x_e + jj * params.nx].speeds[3]; /* west */
-  tmp_cells[ii + jj * params.nx].speeds[4] =
-      cells[ii + y_n * params.nx].speeds[4]; /* south */
-  tmp_cells[ii + jj * params.nx].speeds[5] =
-      cells[x_w + y_s * params.nx].speeds[5]; /* north-east */
-  tmp_cells[ii + jj * params.nx].speeds[6] =
-      cells[x_e + y_s * params.nx].speeds[6]; /* north-west */
-  tmp_cells[ii + jj * params.nx].speeds[7] =
-      cells[x_e + y_n * params.nx].speeds[7]; /* south-west */
-  tmp_cells[ii + jj * params.nx].speeds[8] =
-      cells[x_w + y_n * params.nx].speeds[8]; /* south-east */
-
-  return EXIT_SUCCESS;
-}
-
-int rebound(int ii, int jj, const t_param params, t_speed* cells,
-            t_speed* tmp_cells, int* obstacles) {
-  /* if the cell contains an obstacle */
-  if (obstacles[jj * params.nx + ii]) {
-    /* called after propagate, so taking values from scratch space
-    ** mirroring, and writing into main grid */
-    cells[ii + jj * params.nx].speeds[1] =
-        tmp_cells[ii + jj * params.nx].speeds[3];
-    cells[ii + jj * params.nx].speeds[2] =
-        tmp_cells[ii + jj * params.nx].speeds[4];
-    cells[ii + jj * params.nx].speeds[3] =
-        tmp_cells[ii + jj * params.nx].speeds[1];
-    cells[ii + jj * params.nx].speeds[4] =
-        tmp_cells[ii + jj * params.nx].speeds[2];
-    cells[ii + jj * params.nx].speeds[5] =
-        tmp_cells[ii + jj * params.nx].speeds[7];
-    cells[ii + jj * params.nx].speeds[6] =
-        tmp_cells[ii + jj * params.nx].speeds[8];
-    cells[ii + jj * params.nx].speeds[7] =
-        tmp_cells[ii + jj * params.nx].speeds[5];
-    cells[ii + jj * params.nx].speeds[8] =
-        tmp_cells[ii + jj * params.nx].speeds[6];
-  }
-
-  return EXIT_SUCCESS;
-}
-
-int collision(int ii, int jj, const t_param params, t_speed* cells,
-              t_speed* tmp_cells, int* obstacles) {
-  const float c_sq = 1.f / 3.f; /* square of speed of sound */
-  const float w0 = 4.f / 9.f;   /* weighting factor */
-  const float w1 = 1.f / 9.f;   /* weighting factor */
-  const float w2 = 1.f / 36.f;  /* weighting factor */
-  /* don't consider occupied cells */
-  if (!obstacles[ii + jj * params.nx]) {
-    /* compute local density total */
-    float local_density = 0.f;
+    while (fgets(line, sizeof(line), fp) != NULL) {
+      int tt;
 
-    for (int kk = 0; kk < NSPEEDS; kk++) {
-      local_density += tmp_cells[ii + jj * params.nx].speeds[kk];
+      if (sscanf(line, "%d:", &tt) != 1 || tt >= tt_start) break;
+      stream->offset = ftell(fp);
     }
 
-    /* compute x velocity component */
-    float u_x = (tmp_cells[ii + jj * params.nx].speeds[1] +
-                 tmp_cells[ii + jj * params.nx].speeds[5] +
-                 tmp_cells[ii + jj * params.nx].speeds[8] -
-                 (tmp_cells[ii + jj * params.nx].speeds[3] +
-                  tmp_cells[ii + jj * params.nx].speeds[6] +
-                  tmp_cells[ii + jj * params.nx].speeds[7])) /
-                local_density;
-    /* compute y velocity component */
-    float u_y = (tmp_cells[ii + jj * params.nx].speeds[2] +
-                 tmp_cells[ii + jj * params.nx].speeds[5] +
-                 tmp_cells[ii + jj * params.nx].speeds[6] -
-                 (tmp_cells[ii + jj * params.nx].speeds[4] +
-                  tmp_cells[ii + jj * params.nx].speeds[7] +
-                  tmp_cells[ii + jj * params.nx].speeds[8])) /
-                local_density;
+    fclose(fp);
+  }
 
-    /* velocity squared */
-    float u_sq = u_x * u_x + u_y * u_y;
+  stream->fd = open(AVVELSFILE, O_WRONLY | O_CREAT, 0644);
 
-    /* directional velocity components */
-    float u[NSPEEDS];
-    u[1] = u_x;        /* east */
-    u[2] = u_y;        /* north */
-    u[3] = -u_x;       /* west */
-    u[4] = -u_y;       /* south */
-    u[5] = u_x + u_y;  /* north-east */
-    u[6] = -u_x + u_y; /* north-west */
-    u[7] = -u_x - u_y; /* south-west */
-    u[8] = u_x - u_y;  /* south-east */
+  if (stream->fd < 0 || ftruncate(stream->fd, stream->offset) != 0)
+    die("could not open file output file", __LINE__, __FILE__);
 
-    /* equilibrium densities */
-    float d_equ[NSPEEDS];
-    /* zero velocity density: weight w0 */
-    d_equ[0] = w0 * local_density * (1.f - u_sq / (2.f * c_sq));
-    /* axis speeds: weight w1 */
-    d_equ[1] = w1 * local_density *
-               (1.f + u[1] / c_sq + (u[1] * u[1]) / (2.f * c_sq * c_sq) -
-                u_sq / (2.f * c_sq));
-    d_equ[2] = w1 * local_density *
-               (1.f + u[2] / c_sq + (u[2] * u[2]) / (2.f * c_sq * c_sq) -
-                u_sq / (2.f * c_sq));
-    d_equ[3] = w1 * local_density *
-               (1.f + u[3] / c_sq + (u[3] * u[3]) / (2.f * c_sq * c_sq) -
-                u_sq / (2.f * c_sq));
-    d_equ[4] = w1 * local_density *
-               (1.f + u[4] / c_sq + (u[4] * u[4]) / (2.f * c_sq * c_sq) -
-                u_sq / (2.f * c_sq));
-    /* diagonal speeds: weight w2 */
-    d_equ[5] = w2 * local_density *
-               (1.f + u[5] / c_sq + (u[5] * u[5]) / (2.f * c_sq * c_sq) -
-                u_sq / (2.f * c_sq));
-    d_equ[6] = w2 * local_density *
-               (1.f + u[6] / c_sq + (u[6] * u[6]) / (2.f * c_sq * c_sq) -
-                u_sq / (2.f * c_sq));
-    d_equ[7] = w2 * local_density *
-               (1.f + u[7] / c_sq + (u[7] * u[7]) / (2.f * c_sq * c_sq) -
-                u_sq / (2.f * c_sq));
-    d_equ[8] = w2 * local_density *
-               (1.f + u[8] / c_sq + (u[8] * u[8]) / (2.f * c_sq * c_sq) -
-                u_sq / (2.f * c_sq));
+  for (int cc = 0; cc < 2; cc++) {
+    stream->chunks[cc] = malloc(AV_VELS_CHUNK * AV_VELS_LINE);
 
-    /* relaxation step */
-    for (int kk = 0; kk < NSPEEDS; kk++) {
-      cells[ii + jj * params.nx].speeds[kk] =
-          tmp_cells[ii + jj * params.nx].speeds[kk] +
-          params.omega *
-              (d_equ[kk] - tmp_cells[ii + jj * params.nx].speeds[kk]);
-    }
+    if (stream->chunks[cc] == NULL)
+      die("cannot allocate memory for av_vels", __LINE__, __FILE__);
   }
 
   return EXIT_SUCCESS;
 }
-void SendRecv(t_speed* cells, float* sendbuf, float* recvbuf, int to, int from,
-              int sendRow, int receiveRow, int id, int width) {
-  MPI_Status status;
-  for (int ii = 0; ii < width; ++ii) {
-    for (int jj = 0; jj < NSPEEDS; ++jj) {
-      sendbuf[ii * NSPEEDS + jj] = cells[ii + sendRow * width].speeds[jj];
-    }
-  }
 
-  MPI_Sendrecv(sendbuf, width * NSPEEDS, MPI_FLOAT, to, id, recvbuf,
-               width * NSPEEDS, MPI_FLOAT, from, id, MPI_COMM_WORLD, &status);
+int stream_av_vels(t_av_stream* stream, int tt, const t_accum* av_vels,
+                   int count) {
+  if (stream->fd < 0) return EXIT_SUCCESS;
 
-  for (int ii = 0; ii < width; ++ii) {
-    for (int jj = 0; jj < NSPEEDS; ++jj) {
-      cells[ii + receiveRow * width].speeds[jj] = recvbuf[ii * NSPEEDS + jj];
-    }
+  for (int ii = 0; ii < count; ii++) {
+    if ((tt + ii) % STREAM_AV_VELS != 0) continue;
+
+    char* chunk = stream->chunks[stream->filling];
+
+    stream->length += snprintf(chunk + stream->length, AV_VELS_LINE,
+                               "%d:\t%.12E\n", tt + ii, av_vels[ii]);
+
+    if (++stream->lines == AV_VELS_CHUNK) flush_av_stream(stream, 0);
   }
+
+  return EXIT_SUCCESS;
 }
 
-int halo_exchange(t_speed* cells, float* sendbuf, float* recvbuf, int width,
-                  int height, int domain_start, int domain_size, int rank,
-                  int size) {
-  if (size != 1) {
-    int to, from, sendRow, receiveRow;
+int flush_av_stream(t_av_stream* stream, int wait) {
+  if (stream->fd < 0) return EXIT_SUCCESS;
 
-    to = ((size + rank) - 1) % size;
-    from = ((size + rank) + 1) % size;
-    sendRow = domain_start;
-    receiveRow = (domain_start + domain_size) % height;
+  /* the other chunk fills next, so its write must be done; it was started
+  ** AV_VELS_CHUNK samples ago, unless at a checkpoint */
+  wait_av_stream(stream);
 
-    SendRecv(cells, sendbuf, recvbuf, to, from, sendRow, receiveRow, 0, width);
+  if (stream->length > 0) {
+    memset(&stream->aio, 0, sizeof(stream->aio));
+    stream->aio.aio_fildes = stream->fd;
+    stream->aio.aio_offset = stream->offset;
+    stream->aio.aio_buf = stream->chunks[stream->filling];
+    stream->aio.aio_nbytes = stream->length;
 
-    to = ((size + rank) + 1) % size;
-    from = ((rank + size) - 1) % size;
-    sendRow = (domain_start + domain_size) - 1;
-    receiveRow = ((domain_start + height) - 1) % height;
-    SendRecv(cells, sendbuf, recvbuf, to, from, sendRow, receiveRow, 1, width);
+    if (aio_write(&stream->aio) != 0)
+      die("could not write av_vels", __LINE__, __FILE__);
+
+    stream->pending = 1;
+    stream->offset += stream->length;
+    stream->filling = 1 - stream->filling;
+    stream->lines = 0;
+    stream->length = 0;
   }
+
+  if (wait) wait_av_stream(stream);
+
   return EXIT_SUCCESS;
 }
 
-float av_velocity(const t_param params, t_speed* cells, int* obstacles,
-                  int rank, int domain_start, int domain_size, int sync) {
-  int tot_cells = 0; /* no. of cells used in calculation */
-  float tot_u;       /* accumulated magnitudes of velocity for each cell */
+int wait_av_stream(t_av_stream* stream) {
+  const struct aiocb* list[1] = {&stream->aio};
 
-  /* initialise */
-  tot_u = 0.f;
+  if (!stream->pending) return EXIT_SUCCESS;
 
-  /* loop over all non-blocked cells */
-  for (int jj = domain_start; jj < domain_start + domain_size; jj++) {
-    for (int ii = 0; ii < params.nx; ii++) {
-      /* ignore occupied cells */
-      if (!obstacles[ii + jj * params.nx]) {
-        /* local density total */
-        float local_density = 0.f;
+  while (aio_error(&stream->aio) == EINPROGRESS) aio_suspend(list, 1, NULL);
 
-        for (int kk = 0; kk < NSPEEDS; kk++) {
-          local_density += cells[ii + jj * params.nx].speeds[kk];
-        }
+  if (aio_return(&stream->aio) != (ssize_t)stream->aio.aio_nbytes)
+    die("could not write av_vels", __LINE__, __FILE__);
 
-        /* x-component of velocity */
-        float u_x = (cells[ii + jj * params.nx].speeds[1] +
-                     cells[ii + jj * params.nx].speeds[5] +
-                     cells[ii + jj * params.nx].speeds[8] -
-                     (cells[ii + jj * params.nx].speeds[3] +
-                      cells[ii + jj * params.nx].speeds[6] +
-                      cells[ii + jj * params.nx].speeds[7])) /
-                    local_density;
-        /* compute y velocity component */
-        float u_y = (cells[ii + jj * params.nx].speeds[2] +
-                     cells[ii + jj * params.nx].speeds[5] +
-                     cells[ii + jj * params.nx].speeds[6] -
-                     (cells[ii + jj * params.nx].speeds[4] +
-                      cells[ii + jj * params.nx].speeds[7] +
-                      cells[ii + jj * params.nx].speeds[8])) /
-                    local_density;
+  stream->pending = 0;
 
-        /* accumulate the norm of x- and y- velocity components */
-        tot_u += sqrtf((u_x * u_x) + (u_y * u_y));
-        /* increase counter of inspected cells */
-        ++tot_cells;
-      }
-    }
-  }
+  return EXIT_SUCCESS;
+}
 
-  if (sync == 1) {
-    float sendbuf[2];
-    float recvbuf[2];
+int close_av_stream(t_av_stream* stream) {
+  if (stream->fd < 0) return EXIT_SUCCESS;
 
-    sendbuf[0] = tot_u;
-    sendbuf[1] = (float)tot_cells;
+  flush_av_stream(stream, 1);
+  close(stream->fd);
+  free(stream->chunks[0]);
+  free(stream->chunks[1]);
+  stream->fd = -1;
 
-    MPI_Reduce(&sendbuf, &recvbuf, 2, MPI_FLOAT, MPI_SUM, 0, MPI_COMM_WORLD);
+  return EXIT_SUCCESS;
+}
+#endif
 
-    if (rank == 0) {
-      float result = recvbuf[0] / recvbuf[1];
-      return result;
-    } else {
-      return tot_u / (float)tot_cells;
-    }
-  } else {
-    return tot_u / (float)tot_cells;
+int write_state(const t_param params, const t_domain domain, t_speed* cells,
+                const t_obstacles* obstacles) {
+  const char names[STATE_FIELDS][STATE_NAME_LEN] = {"u_x", "u_y", "u",
+                                                    "pressure", "obstacle"};
+  const int header_size =
+      sizeof(STATE_MAGIC) + 3 * sizeof(int32_t) + sizeof(names);
+  MPI_File fh;
+  MPI_Datatype tile; /* this process's cells within the file */
+  float* values;     /* the fields of the owned cells */
+
+  if (MPI_File_open(domain.comm, FINALSTATEBINFILE,
+                    MPI_MODE_CREATE | MPI_MODE_WRONLY, MPI_INFO_NULL,
+                    &fh) != MPI_SUCCESS) {
+    die("could not open file output file", __LINE__, __FILE__);
   }
-}
 
-int sync_grid(t_speed* cells, int rank, int domain_start, int domain_size,
-              int rows, int columns, int ranks) {
-  if (rank != MASTER) {
-    float* send = malloc(columns * domain_size * NSPEEDS * sizeof(float));
+  /* drop anything left over from a longer file */
+  MPI_File_set_size(fh, 0);
 
-    for (int jj = 0; jj < domain_size; ++jj) {
-      for (int ii = 0; ii < columns; ++ii) {
-        for (int kk = 0; kk < NSPEEDS; ++kk) {
-          send[kk + NSPEEDS * (ii + columns * jj)] =
-              cells[ii + columns * (jj + domain_start)].speeds[kk];
-        }
-      }
-    }
+  if (domain.rank == MASTER) {
+    char header[sizeof(STATE_MAGIC) + 3 * sizeof(int32_t) + sizeof(names)];
+    const int32_t dims[3] = {params.nx, params.ny, STATE_FIELDS};
 
-    MPI_Send(send, columns * domain_size * NSPEEDS, MPI_FLOAT, MASTER, 2,
-             MPI_COMM_WORLD);
-    free(send);
-  } else {
-    MPI_Status status;
-    for (int i = 0; i < ranks; ++i) {
-      if (i == MASTER) continue;
-      int rank_start = 0;
-      int rank_size = 0;
-
-      for (int j = 0; j < rows; ++j) {
-        if (j % ranks == i) {
-          rank_size++;
-        }
-        if (j % ranks < i) {
-          rank_start++;
-        }
-      }
+    memcpy(header, STATE_MAGIC, sizeof(STATE_MAGIC));
+    memcpy(header + sizeof(STATE_MAGIC), dims, sizeof(dims));
+    memcpy(header + sizeof(STATE_MAGIC) + sizeof(dims), names, sizeof(names));
+    MPI_File_write_at(fh, 0, header, header_size, MPI_BYTE,
+                      MPI_STATUS_IGNORE);
+  }
 
-      float* recv = malloc(columns * rank_size * NSPEEDS * sizeof(float));
+  values = malloc(sizeof(float) * STATE_FIELDS * domain.nx * domain.ny);
 
-      MPI_Recv(recv, columns * rank_size * NSPEEDS, MPI_FLOAT, i, 2,
-               MPI_COMM_WORLD, &status);
+  if (values == NULL)
+    die("cannot allocate memory for final state", __LINE__, __FILE__);
 
-      for (int jj = 0; jj < rank_size; ++jj) {
-        for (int ii = 0; ii < columns; ++ii) {
-          for (int kk = 0; kk < NSPEEDS; ++kk) {
-            cells[ii + columns * (jj + rank_start)].speeds[kk] =
-                recv[kk + NSPEEDS * (ii + columns * jj)];
-          }
-        }
-      }
-      free(recv);
+  for (int jj = 0; jj < domain.ny; jj++) {
+    for (int ii = 0; ii < domain.nx; ii++) {
+      float* fields = values + STATE_FIELDS * (ii + jj * domain.nx);
+      const int blocked = BLOCKED(obstacles, ii + 1, jj + 1);
+      t_real state[4]; /* u_x, u_y, u and pressure in grid cell */
+
+      cell_state(params, cells, (ii + 1) + (jj + 1) * domain.width, blocked,
+                 state);
+
+      /* the file holds floats whatever the precision of the run */
+      for (int ff = 0; ff < 4; ff++) fields[ff] = (float)state[ff];
+      fields[4] = (float)blocked;
     }
   }
 
+  file_tile(params, domain, STATE_FIELDS, MPI_FLOAT, &tile);
+  MPI_File_set_view(fh, header_size, MPI_FLOAT, tile, "native",
+                    MPI_INFO_NULL);
+  MPI_File_write_all(fh, values, STATE_FIELDS * domain.nx * domain.ny,
+                     MPI_FLOAT, MPI_STATUS_IGNORE);
+
+  MPI_File_close(&fh);
+  MPI_Type_free(&tile);
+  free(values);
+
   return EXIT_SUCCESS;
 }
 
-int initialise(const char* paramfile, const char* obstaclefile, t_param* params,
-               t_speed** cells_ptr, t_speed** tmp_cells_ptr,
-               int** obstacles_ptr, float** av_vels_ptr) {
-  char message[1024]; /* message buffer */
-  FILE* fp;           /* file pointer */
-  int xx, yy;         /* generic array indices */
-  int blocked;        /* indicates whether a cell is blocked by an obstacle */
-  int retval;         /* to hold return value for checking */
+int file_tile(const t_param params, const t_domain domain, int count,
+              MPI_Datatype type, MPI_Datatype* tile) {
+  /* the tile is a block of whole cells within the rows of the file */
+  const int sizes[2] = {params.ny, params.nx * count};
+  const int subsizes[2] = {domain.ny, domain.nx * count};
+  const int starts[2] = {domain.y_start, domain.x_start * count};
 
-  /* open the parameter file */
-  fp = fopen(paramfile, "r");
+  MPI_Type_create_subarray(2, sizes, subsizes, starts, MPI_ORDER_C, type,
+                           tile);
+  MPI_Type_commit(tile);
 
-  if (fp == NULL) {
-    sprintf(message, "could not open input parameter file: %s", paramfile);
-    die(message, __LINE__, __FILE__);
+  return EXIT_SUCCESS;
+}
+
+int write_checkpoint(const t_param params, const t_domain domain,
+                     t_speed* cells, t_accum* av_vels, int tt) {
+  const char* tmpfile = CHECKPOINTFILE ".tmp";
+  const int header_size = sizeof(CHECKPOINT_MAGIC) + 3 * sizeof(int32_t);
+  MPI_File fh;
+  MPI_Datatype tile; /* this process's cells within the file */
+  t_real* speeds;    /* the speeds of the owned cells */
+
+  /* write a new file and move it over the old one once complete, so a
+  ** run killed part way through still leaves the last checkpoint */
+  if (MPI_File_open(domain.comm, tmpfile, MPI_MODE_CREATE | MPI_MODE_WRONLY,
+                    MPI_INFO_NULL, &fh) != MPI_SUCCESS) {
+    die("could not open checkpoint file", __LINE__, __FILE__);
   }
 
-  /* read in the parameter values */
-  retval = fscanf(fp, "%d\n", &(params->nx));
+  MPI_File_set_size(fh, 0);
 
-  if (retval != 1) die("could not read param file: nx", __LINE__, __FILE__);
+  if (domain.rank == MASTER) {
+    char header[sizeof(CHECKPOINT_MAGIC) + 3 * sizeof(int32_t)];
+    const int32_t dims[3] = {params.nx, params.ny, tt};
 
-  retval = fscanf(fp, "%d\n", &(params->ny));
+    memcpy(header, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+    memcpy(header + sizeof(CHECKPOINT_MAGIC), dims, sizeof(dims));
+    MPI_File_write_at(fh, 0, header, header_size, MPI_BYTE,
+                      MPI_STATUS_IGNORE);
+    MPI_File_write_at(fh, header_size, av_vels, CHECKPOINT_AV_VELS(tt),
+                      ACCUM_MPI, MPI_STATUS_IGNORE);
+  }
+
+  speeds = malloc(sizeof(t_real) * NSPEEDS * domain.nx * domain.ny);
 
-  if (retval != 1) die("could not read param file: ny", __LINE__, __FILE__);
+  if (speeds == NULL)
+    die("cannot allocate memory for checkpoint", __LINE__, __FILE__);
+
+  for (int jj = 0; jj < domain.ny; jj++) {
+    for (int ii = 0; ii < domain.nx; ii++) {
+      for (int kk = 0; kk < NSPEEDS; kk++) {
+        speeds[kk + NSPEEDS * (ii + jj * domain.nx)] =
+            SPEED(cells, (ii + 1) + (jj + 1) * domain.width, kk);
+      }
+    }
+  }
 
-  retval = fscanf(fp, "%d\n", &(params->maxIters));
+  file_tile(params, domain, NSPEEDS, REAL_MPI, &tile);
+  MPI_File_set_view(fh, header_size + sizeof(t_accum) * CHECKPOINT_AV_VELS(tt),
+                    REAL_MPI, tile, "native", MPI_INFO_NULL);
+  MPI_File_write_all(fh, speeds, NSPEEDS * domain.nx * domain.ny, REAL_MPI,
+                     MPI_STATUS_IGNORE);
 
-  if (retval != 1)
-    die("could not read param file: maxIters", __LINE__, __FILE__);
+  /* closing is collective, so every process has finished writing */
+  MPI_File_close(&fh);
+  MPI_Type_free(&tile);
+  free(speeds);
 
-  retval = fscanf(fp, "%d\n", &(params->reynolds_dim));
+  if (domain.rank == MASTER && rename(tmpfile, CHECKPOINTFILE) != 0)
+    die("could not rename checkpoint file", __LINE__, __FILE__);
 
-  if (retval != 1)
-    die("could not read param file: reynolds_dim", __LINE__, __FILE__);
+  return EXIT_SUCCESS;
+}
 
-  retval = fscanf(fp, "%f\n", &(params->density));
+int read_checkpoint(const char* checkpointfile, const t_param params,
+                    const t_domain domain, t_speed* cells, t_accum* av_vels,
+                    int* tt) {
+  char header[sizeof(CHECKPOINT_MAGIC) + 3 * sizeof(int32_t)];
+  int32_t dims[3];
+  MPI_File fh;
+  MPI_Datatype tile; /* this process's cells within the file */
+  t_real* speeds;    /* the speeds of the owned cells */
+
+  if (MPI_File_open(domain.comm, checkpointfile, MPI_MODE_RDONLY,
+                    MPI_INFO_NULL, &fh) != MPI_SUCCESS) {
+    die("could not open checkpoint file", __LINE__, __FILE__);
+  }
 
-  if (retval != 1)
-    die("could not read param file: density", __LINE__, __FILE__);
+  /* every process reads the header, so they all check it */
+  MPI_File_read_at_all(fh, 0, header, sizeof(header), MPI_BYTE,
+                       MPI_STATUS_IGNORE);
+  memcpy(dims, header + sizeof(CHECKPOINT_MAGIC), sizeof(dims));
 
-  retval = fscanf(fp, "%f\n", &(params->accel));
+  if (memcmp(header, CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC)) != 0)
+    die("not a checkpoint file", __LINE__, __FILE__);
 
-  if (retval != 1) die("could not read param file: accel", __LINE__, __FILE__);
+  if (dims[0] != params.nx || dims[1] != params.ny)
+    die("checkpoint grid size does not match the param file", __LINE__,
+        __FILE__);
 
-  retval = fscanf(fp, "%f\n", &(params->omega));
+  if (dims[2] < 0 || dims[2] > params.maxIters)
+    die("checkpoint timestep out of range", __LINE__, __FILE__);
 
-  if (retval != 1) die("could not read param file: omega", __LINE__, __FILE__);
+  *tt = dims[2];
 
-  /* and close up the file */
-  fclose(fp);
+  MPI_File_read_at_all(fh, sizeof(header), av_vels, CHECKPOINT_AV_VELS(*tt),
+                       ACCUM_MPI, MPI_STATUS_IGNORE);
 
-  /*
-  ** Allocate memory.
-  **
-  ** Remember C is pass-by-value, so we need to
-  ** pass pointers into the initialise function.
-  **
-  ** NB we are allocating a 1D array, so that the
-  ** memory will be contiguous.  We still want to
-  ** index this memory as if it were a (row major
-  ** ordered) 2D array, however.  We will perform
-  ** some arithmetic using the row and column
-  ** coordinates, inside the square brackets, when
-  ** we want to access elements of this array.
-  **
-  ** Note also that we are using a structure to
-  ** hold an array of 'speeds'.  We will allocate
-  ** a 1D array of these structs.
-  */
+  speeds = malloc(sizeof(t_real) * NSPEEDS * domain.nx * domain.ny);
 
-  /* main grid */
-  *cells_ptr = (t_speed*)malloc(sizeof(t_speed) * (params->ny * params->nx));
+  if (speeds == NULL)
+    die("cannot allocate memory for checkpoint", __LINE__, __FILE__);
 
-  if (*cells_ptr == NULL)
-    die("cannot allocate memory for cells", __LINE__, __FILE__);
+  file_tile(params, domain, NSPEEDS, REAL_MPI, &tile);
+  MPI_File_set_view(fh,
+                    sizeof(header) + sizeof(t_accum) * CHECKPOINT_AV_VELS(*tt),
+                    REAL_MPI, tile, "native", MPI_INFO_NULL);
+  MPI_File_read_all(fh, speeds, NSPEEDS * domain.nx * domain.ny, REAL_MPI,
+                    MPI_STATUS_IGNORE);
 
-  /* 'helper' grid, used as scratch space */
-  *tmp_cells_ptr =
-      (t_speed*)malloc(sizeof(t_speed) * (params->ny * params->nx));
+  for (int jj = 0; jj < domain.ny; jj++) {
+    for (int ii = 0; ii < domain.nx; ii++) {
+      for (int kk = 0; kk < NSPEEDS; kk++) {
+        SPEED(cells, (ii + 1) + (jj + 1) * domain.width, kk) =
+            speeds[kk + NSPEEDS * (ii + jj * domain.nx)];
+      }
+    }
+  }
 
-  if (*tmp_cells_ptr == NULL)
-    die("cannot allocate memory for tmp_cells", __LINE__, __FILE__);
+  MPI_File_close(&fh);
+  MPI_Type_free(&tile);
+  free(speeds);
 
-  /* the map of obstacles */
-  *obstacles_ptr = malloc(sizeof(int) * (params->ny * params->nx));
+  return EXIT_SUCCESS;
+}
 
-  if (*obstacles_ptr == NULL)
-    die("cannot allocate column memory for obstacles", __LINE__, __FILE__);
+#ifdef PROFILE
+int report_profile(const t_domain domain, const double* profile,
+                   const char* const* phase_names, int steps) {
+  double min[NPHASES], max[NPHASES], sum[NPHASES];
+  double* all = NULL; /* every process's times, on MASTER */
 
-  /* initialise densities */
-  float w0 = params->density * 4.f / 9.f;
-  float w1 = params->density / 9.f;
-  float w2 = params->density / 36.f;
+  if (domain.rank == MASTER) {
+    all = malloc(sizeof(double) * NPHASES * domain.size);
 
-  for (int jj = 0; jj < params->ny; jj++) {
-    for (int ii = 0; ii < params->nx; ii++) {
-      /* centre */
-      (*cells_ptr)[ii + jj * params->nx].speeds[0] = w0;
-      /* axis directions */
-      (*cells_ptr)[ii + jj * params->nx].speeds[1] = w1;
-      (*cells_ptr)[ii + jj * params->nx].speeds[2] = w1;
-      (*cells_ptr)[ii + jj * params->nx].speeds[3] = w1;
-      (*cells_ptr)[ii + jj * params->nx].speeds[4] = w1;
-      /* diagonals */
-      (*cells_ptr)[ii + jj * params->nx].speeds[5] = w2;
-      (*cells_ptr)[ii + jj * params->nx].speeds[6] = w2;
-      (*cells_ptr)[ii + jj * params->nx].speeds[7] = w2;
-      (*cells_ptr)[ii + jj * params->nx].speeds[8] = w2;
-    }
+    if (all == NULL)
+      die("cannot allocate memory for profile", __LINE__, __FILE__);
   }
 
-  /* first set all cells in obstacle array to zero */
-  for (int jj = 0; jj < params->ny; jj++) {
-    for (int ii = 0; ii < params->nx; ii++) {
-      (*obstacles_ptr)[ii + jj * params->nx] = 0;
-    }
-  }
+  MPI_Reduce(profile, min, NPHASES, MPI_DOUBLE, MPI_MIN, MASTER, domain.comm);
+  MPI_Reduce(profile, max, NPHASES, MPI_DOUBLE, MPI_MAX, MASTER, domain.comm);
+  MPI_Reduce(profile, sum, NPHASES, MPI_DOUBLE, MPI_SUM, MASTER, domain.comm);
+  MPI_Gather(profile, NPHASES, MPI_DOUBLE, all, NPHASES, MPI_DOUBLE, MASTER,
+             domain.comm);
 
-  /* open the obstacle data file */
-  fp = fopen(obstaclefile, "r");
+  if (domain.rank != MASTER) return EXIT_SUCCESS;
 
-  if (fp == NULL) {
-    sprintf(message, "could not open input obstacles file: %s", obstaclefile);
-    die(message, __LINE__, __FILE__);
-  }
+  /* imbalance is the slowest process relative to the mean, so 1 is
+  ** perfectly balanced */
+  printf("==profile== (%d timesteps, %d processes)\n", steps, domain.size);
+  printf("%-12s %12s %12s %12s %10s\n", "phase", "min (s)", "mean (s)",
+         "max (s)", "imbalance");
 
-  /* read-in the blocked cells list */
-  while ((retval = fscanf(fp, "%d %d %d\n", &xx, &yy, &blocked)) != EOF) {
-    /* some checks */
-    if (retval != 3)
-      die("expected 3 values per line in obstacle file", __LINE__, __FILE__);
+  for (int pp = 0; pp < NPHASES; pp++) {
+    const double mean = sum[pp] / domain.size;
 
-    if (xx < 0 || xx > params->nx - 1)
-      die("obstacle x-coord out of range", __LINE__, __FILE__);
+    if (max[pp] == 0.0) continue;
 
-    if (yy < 0 || yy > params->ny - 1)
-      die("obstacle y-coord out of range", __LINE__, __FILE__);
+    printf("%-12s %12.6lf %12.6lf %12.6lf %10.3lf\n", phase_names[pp],
+           min[pp], mean, max[pp], max[pp] / mean);
+  }
 
-    if (blocked != 1)
-      die("obstacle blocked value should be 1", __LINE__, __FILE__);
+  FILE* fp = fopen(PROFILEFILE, "w");
 
-    /* assign to array */
-    (*obstacles_ptr)[xx + yy * params->nx] = blocked;
+  if (fp == NULL) {
+    die("could not open file output file", __LINE__, __FILE__);
   }
 
-  /* and close the file */
-  fclose(fp);
+  fprintf(fp, "rank");
+  for (int pp = 0; pp < NPHASES; pp++) fprintf(fp, ",%s", phase_names[pp]);
+  fprintf(fp, "\n");
 
-  /*
-  ** allocate space to hold a record of the avarage velocities computed
-  ** at each timestep
-  */
-  *av_vels_ptr = (float*)malloc(sizeof(float) * params->maxIters);
+  for (int rr = 0; rr < domain.size; rr++) {
+    fprintf(fp, "%d", rr);
+    for (int pp = 0; pp < NPHASES; pp++) {
+      fprintf(fp, ",%.9lf", all[pp + rr * NPHASES]);
+    }
+    fprintf(fp, "\n");
+  }
+
+  fclose(fp);
+  free(all);
 
   return EXIT_SUCCESS;
 }
+#endif
 
-int finalise(const t_param* params, t_speed** cells_ptr,
-             t_speed** tmp_cells_ptr, int** obstacles_ptr,
-             float** av_vels_ptr) {
-  /*
-  ** free up allocated memory
-  */
-  free(*cells_ptr);
-  *cells_ptr = NULL;
+#ifdef CHECK_RESULTS
+int check_results(const t_param params, const t_domain domain,
+                  t_speed* cells, const t_obstacles* obstacles,
+                  const char* refdir) {
+  char header[sizeof(STATE_MAGIC) + 3 * sizeof(int32_t) +
+              STATE_FIELDS * STATE_NAME_LEN];
+  char filename[4096 + 64];
+  int32_t dims[3];
+  MPI_File fh;
+  MPI_Datatype tile; /* this process's cells within the file */
+  float* ref;        /* the reference fields of the owned cells */
+  /* the largest absolute percentage and where it is, as a cell of the
+  ** whole grid, for MPI_MAXLOC; a nan beats everything, as in check.py */
+  struct {
+    double size;
+    int cell;
+  } worst = {-1, 0}, state_worst;
+  int passed;
+
+  snprintf(filename, sizeof(filename), "%s/%dx%d.final_state.bin", refdir,
+           params.nx, params.ny);
+
+  if (MPI_File_open(domain.comm, filename, MPI_MODE_RDONLY, MPI_INFO_NULL,
+                    &fh) != MPI_SUCCESS) {
+    if (domain.rank == MASTER)
+      printf("Check:				no reference results in %s\n", refdir);
+
+    return EXIT_SUCCESS;
+  }
 
-  free(*tmp_cells_ptr);
-  *tmp_cells_ptr = NULL;
+  MPI_File_read_at_all(fh, 0, header, sizeof(header), MPI_BYTE,
+                       MPI_STATUS_IGNORE);
+  memcpy(dims, header + sizeof(STATE_MAGIC), sizeof(dims));
 
-  free(*obstacles_ptr);
-  *obstacles_ptr = NULL;
+  if (memcmp(header, STATE_MAGIC, sizeof(STATE_MAGIC)) != 0 ||
+      dims[0] != params.nx || dims[1] != params.ny ||
+      dims[2] != STATE_FIELDS) {
+    die("reference final state does not match the grid", __LINE__, __FILE__);
+  }
 
-  free(*av_vels_ptr);
-  *av_vels_ptr = NULL;
+  ref = malloc(sizeof(float) * STATE_FIELDS * domain.nx * domain.ny);
 
-  /* finialise the MPI enviroment */
-  MPI_Finalize();
+  if (ref == NULL)
+    die("cannot allocate memory for reference state", __LINE__, __FILE__);
 
-  return EXIT_SUCCESS;
-}
+  file_tile(params, domain, STATE_FIELDS, MPI_FLOAT, &tile);
+  MPI_File_set_view(fh, sizeof(header), MPI_FLOAT, tile, "native",
+                    MPI_INFO_NULL);
+  MPI_File_read_all(fh, ref, STATE_FIELDS * domain.nx * domain.ny, MPI_FLOAT,
+                    MPI_STATUS_IGNORE);
+  MPI_File_close(&fh);
+  MPI_Type_free(&tile);
 
-float calc_reynolds(const t_param params, t_speed* cells, int* obstacles,
-                    int height) {
-  const float viscosity = 1.f / 6.f * (2.f / params.omega - 1.f);
+  /* the pressures, as written out */
+  for (int jj = 0; jj < domain.ny; jj++) {
+    for (int ii = 0; ii < domain.nx; ii++) {
+      const int blocked = BLOCKED(obstacles, ii + 1, jj + 1);
+      const double expected = ref[STATE_FIELDS * (ii + jj * domain.nx) + 3];
+      t_real state[4]; /* u_x, u_y, u and pressure in grid cell */
 
-  return av_velocity(params, cells, obstacles, 0, 0, height, 0) *
-         params.reynolds_dim / viscosity;
-}
+      cell_state(params, cells, (ii + 1) + (jj + 1) * domain.width, blocked,
+                 state);
 
-float total_density(const t_param params, t_speed* cells) {
-  float total = 0.f; /* accumulator */
+      const double diff = expected - (float)state[3];
+      const double percent = 100.0 * (diff / (expected - diff));
+      const double size = isnan(percent) ? INFINITY : fabs(percent);
 
-  for (int jj = 0; jj < params.ny; jj++) {
-    for (int ii = 0; ii < params.nx; ii++) {
-      for (int kk = 0; kk < NSPEEDS; kk++) {
-        total += cells[ii + jj * params.nx].speeds[kk];
+      if (size > worst.size) {
+        worst.size = size;
+        worst.cell = (domain.x_start + ii) + (domain.y_start + jj) * params.nx;
       }
     }
   }
 
-  return total;
-}
+  free(ref);
 
-int write_values(const t_param params, t_speed* cells, int* obstacles,
-                 float* av_vels) {
-  FILE* fp;                     /* file pointer */
-  const float c_sq = 1.f / 3.f; /* sq. of speed of sound */
-  float local_density;          /* per grid cell sum of densities */
-  float pressure;               /* fluid pressure in grid cell */
-  float u_x;                    /* x-component of velocity in grid cell */
-  float u_y;                    /* y-component of velocity in grid cell */
-  float u; /* norm--root of summed squares--of u_x and u_y */
+  MPI_Allreduce(&worst, &state_worst, 1, MPI_DOUBLE_INT, MPI_MAXLOC,
+                domain.comm);
 
-  fp = fopen(FINALSTATEFILE, "w");
+  if (domain.rank == MASTER) {
+    double* av_vels = malloc(sizeof(double) * 2 * params.maxIters);
+    int steps;
+    int ref_steps;
+    int step = 0;
 
-  if (fp == NULL) {
-    die("could not open file output file", __LINE__, __FILE__);
-  }
+    if (av_vels == NULL)
+      die("cannot allocate memory for av_vels check", __LINE__, __FILE__);
 
-  for (int jj = 0; jj < params.ny; jj++) {
-    for (int ii = 0; ii < params.nx; ii++) {
-      /* an occupied cell */
-      if (obstacles[ii + jj * params.nx]) {
-        u_x = u_y = u = 0.f;
-        pressure = params.density * c_sq;
-      } /* no obstacle */ else {
-        local_density = 0.f;
+    snprintf(filename, sizeof(filename), "%s/%dx%d.av_vels.dat", refdir,
+             params.nx, params.ny);
+    ref_steps = read_av_vels(filename, params.maxIters, av_vels);
+    steps = read_av_vels(AVVELSFILE, params.maxIters,
+                         av_vels + params.maxIters);
 
-        for (int kk = 0; kk < NSPEEDS; kk++) {
-          local_density += cells[ii + jj * params.nx].speeds[kk];
-        }
+    worst.size = -1;
+    for (int tt = 0; tt < params.maxIters && tt < steps; tt++) {
+      const double diff = av_vels[tt] - av_vels[params.maxIters + tt];
+      const double percent = 100.0 * (diff / (av_vels[tt] - diff));
+      const double size = isnan(percent) ? INFINITY : fabs(percent);
 
-        /* compute x velocity component */
-        u_x = (cells[ii + jj * params.nx].speeds[1] +
-               cells[ii + jj * params.nx].speeds[5] +
-               cells[ii + jj * params.nx].speeds[8] -
-               (cells[ii + jj * params.nx].speeds[3] +
-                cells[ii + jj * params.nx].speeds[6] +
-                cells[ii + jj * params.nx].speeds[7])) /
-              local_density;
-        /* compute y velocity component */
-        u_y = (cells[ii + jj * params.nx].speeds[2] +
-               cells[ii + jj * params.nx].speeds[5] +
-               cells[ii + jj * params.nx].speeds[6] -
-               (cells[ii + jj * params.nx].speeds[4] +
-                cells[ii + jj * params.nx].speeds[7] +
-                cells[ii + jj * params.nx].speeds[8])) /
-              local_density;
-        /* compute norm of velocity */
-        u = sqrtf((u_x * u_x) + (u_y * u_y));
-        /* compute pressure */
-        pressure = local_density * c_sq;
+      if (size > worst.size) {
+        worst.size = size;
+        step = tt;
       }
+    }
 
-      /* write to file */
-      fprintf(fp, "%d %d %.12E %.12E %.12E %.12E %d\n", ii, jj, u_x, u_y, u,
-              pressure, obstacles[ii * params.nx + jj]);
+    passed = ref_steps == steps && steps == params.maxIters &&
+             worst.size <= CHECK_TOLERANCE &&
+             state_worst.size <= CHECK_TOLERANCE;
+
+    if (ref_steps != steps || steps != params.maxIters) {
+      printf("Max av_vels difference:\t\t%d vs. %d steps\n", steps,
+             ref_steps);
+    } else {
+      printf("Max av_vels difference:\t\t%.2g%% at step %d\n", worst.size,
+             step);
     }
+    printf("Max pressure difference:\t%.2g%% at (%d,%d)\n", state_worst.size,
+           state_worst.cell % params.nx, state_worst.cell / params.nx);
+    printf("Check:\t\t\t\t%s\n", passed ? "PASS" : "FAIL");
+
+    free(av_vels);
+  }
+
+  MPI_Bcast(&passed, 1, MPI_INT, MASTER, domain.comm);
+
+  return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+int read_av_vels(const char* filename, int capacity, double* values) {
+  FILE* fp = fopen(filename, "r");
+  double value;
+  int count = 0;
+
+  if (fp == NULL) return -1;
+
+  /* "tt:\tvalue" lines, in order */
+  while (fscanf(fp, "%*d:%lf", &value) == 1) {
+    if (count < capacity) values[count] = value;
+    count++;
   }
 
   fclose(fp);
 
-  fp = fopen(AVVELSFILE, "w");
+  return count;
+}
+#endif
 
-  if (fp == NULL) {
-    die("could not open file output file", __LINE__, __FILE__);
+#ifdef DIAGNOSE
+int write_diagnostics(const t_param params, const t_domain domain,
+                      t_speed* cells, const t_obstacles* obstacles, int tt) {
+  const t_real c_sq = (t_real)1 / 3; /* sq. of speed of sound */
+  const t_real viscosity = (t_real)1 / 6 * (2 / params.omega - 1);
+  const int blocks_x = (params.nx + DIAG_BLOCK - 1) / DIAG_BLOCK;
+  const int blocks_y = (params.ny + DIAG_BLOCK - 1) / DIAG_BLOCK;
+  const int nblocks = blocks_x * blocks_y;
+  /* the rows of blocks holding owned rows */
+  const int first = domain.y_start / DIAG_BLOCK;
+  const int last = (domain.y_start + domain.ny - 1) / DIAG_BLOCK;
+  /* DIAG_FIELDS sums per block, then the velocity norms and density */
+  t_accum* sums = calloc((size_t)DIAG_FIELDS * nblocks + 2, sizeof(t_accum));
+  t_real extremes[2]; /* minus the minimum and the maximum speed */
+  t_accum tot_u = 0;  /* accumulated velocity norms of the fluid cells */
+  t_real u_min = INFINITY;
+  t_real u_max = -INFINITY;
+
+  if (sums == NULL)
+    die("cannot allocate memory for diagnostics", __LINE__, __FILE__);
+
+  /* a thread per row of blocks, so no two write the same block */
+#pragma omp parallel for schedule(static) reduction(+ : tot_u) \
+    reduction(min : u_min) reduction(max : u_max)
+  for (int by = first; by <= last; by++) {
+    const int jj_start =
+        by * DIAG_BLOCK > domain.y_start ? by * DIAG_BLOCK - domain.y_start
+                                         : 0;
+    const int jj_end = (by + 1) * DIAG_BLOCK - domain.y_start < domain.ny
+                           ? (by + 1) * DIAG_BLOCK - domain.y_start
+                           : domain.ny;
+    t_accum* row = sums + (size_t)DIAG_FIELDS * blocks_x * by;
+
+    for (int jj = jj_start + 1; jj <= jj_end; jj++) {
+      for (int ii = 1; ii <= domain.nx; ii++) {
+        if (!BLOCKED(obstacles, ii, jj)) {
+          t_real state[4]; /* u_x, u_y, u and pressure */
+          t_accum* block =
+              row + DIAG_FIELDS * ((domain.x_start + ii - 1) / DIAG_BLOCK);
+
+          cell_state(params, cells, ii + jj * domain.width, 0, state);
+          block[0] += state[0];
+          block[1] += state[1];
+          block[2] += state[3];
+          block[3] += 1;
+          tot_u += state[2];
+          if (state[2] < u_min) u_min = state[2];
+          if (state[2] > u_max) u_max = state[2];
+        }
+      }
+    }
   }
 
-  for (int ii = 0; ii < params.maxIters; ii++) {
-    fprintf(fp, "%d:\t%.12E\n", ii, av_vels[ii]);
+  sums[DIAG_FIELDS * nblocks] = tot_u;
+  sums[DIAG_FIELDS * nblocks + 1] = total_density(params, domain, cells);
+  extremes[0] = -u_min;
+  extremes[1] = u_max;
+
+  if (domain.rank == MASTER) {
+    MPI_Reduce(MPI_IN_PLACE, sums, DIAG_FIELDS * nblocks + 2, ACCUM_MPI,
+               MPI_SUM, MASTER, domain.comm);
+    MPI_Reduce(MPI_IN_PLACE, extremes, 2, REAL_MPI, MPI_MAX, MASTER,
+               domain.comm);
+  } else {
+    MPI_Reduce(sums, NULL, DIAG_FIELDS * nblocks + 2, ACCUM_MPI, MPI_SUM,
+               MASTER, domain.comm);
+    MPI_Reduce(extremes, NULL, 2, REAL_MPI, MPI_MAX, MASTER, domain.comm);
   }
 
-  fclose(fp);
+  if (domain.rank == MASTER) {
+    const t_accum reynolds = sums[DIAG_FIELDS * nblocks] /
+                             params.fluid_cells * params.reynolds_dim /
+                             viscosity;
+    char filename[sizeof(DIAG_FIELD_FILE) + 16];
+    /* a run from scratch starts the file afresh, a restart carries on */
+    FILE* fp = fopen(DIAGFILE, tt == DIAGNOSE ? "w" : "a");
+
+    if (fp == NULL) die("could not open diagnostics file", __LINE__, __FILE__);
+
+    fprintf(fp, "%d:\t%.12E\t%.12E\t%.12E\t%.12E\n", tt, -extremes[0],
+            extremes[1], sums[DIAG_FIELDS * nblocks + 1], reynolds);
+    fclose(fp);
+
+    snprintf(filename, sizeof(filename), DIAG_FIELD_FILE, tt);
+    fp = fopen(filename, "w");
+
+    if (fp == NULL) die("could not open diagnostics file", __LINE__, __FILE__);
+
+    for (int by = 0; by < blocks_y; by++) {
+      for (int bx = 0; bx < blocks_x; bx++) {
+        const t_accum* block = sums + DIAG_FIELDS * (bx + by * blocks_x);
+        const int count = (int)block[3];
+        /* a block of obstacles only is written like an obstacle cell */
+        const t_accum u_x = count > 0 ? block[0] / count : 0;
+        const t_accum u_y = count > 0 ? block[1] / count : 0;
+        const t_accum pressure =
+            count > 0 ? block[2] / count : params.density * c_sq;
+
+        fprintf(fp, "%d %d %.12E %.12E %.12E %.12E %d\n", bx, by, u_x, u_y,
+                sqrt(u_x * u_x + u_y * u_y), pressure, count);
+      }
+    }
+
+    fclose(fp);
+  }
+
+  free(sums);
 
   return EXIT_SUCCESS;
 }
+#endif
 
 void die(const char* message, const int line, const char* file) {
   fprintf(stderr, "Error at line %d of file %s:\n", line, file);
   fprintf(stderr, "%s\n", message);
   fflush(stderr);
+  /* the other processes may be waiting on MASTER, which reads the files */
+  MPI_Abort(MPI_COMM_WORLD, EXIT_FAILURE);
   exit(EXIT_FAILURE);
 }
 
 void usage(const char* exe) {
-  fprintf(stderr, "Usage: %s <paramfile> <obstaclefile>\n", exe);
+  fprintf(stderr, "Usage: %s <paramfile> <obstaclefile> [checkpointfile]\n",
+          exe);
+  fprintf(stderr, "   or: %s <ensemblefile>\n", exe);
   exit(EXIT_FAILURE);
 }
+
+#endif /* BAD_FLAGS */
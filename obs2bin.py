@@ -0,0 +1,58 @@
+#!/usr/bin/env python
+
+"""Convert a text obstacle file, one "x y 1" line per blocked cell, to the
+binary bitmap format d2q9-bgk also reads: a header of the magic and nx and
+ny as int32s, then ny rows of (nx + 31) / 32 uint32s, with bit x % 32 of
+word x / 32 of row y set if cell (x, y) is blocked."""
+
+import argparse
+import struct
+
+MAGIC = b"D2Q9OBS\0"
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description="Convert a text obstacle file to binary",
+        formatter_class=argparse.ArgumentDefaultsHelpFormatter,
+        )
+    parser.add_argument("param_file",
+        help="""parameter file giving the grid size""")
+    parser.add_argument("text_file",
+        help="""text obstacle file to read""")
+    parser.add_argument("binary_file", nargs="?", default=None,
+        help="""binary obstacle file to write, default the text file
+        with a .bin extension""")
+    args = parser.parse_args()
+
+    with open(args.param_file) as params:
+        nx, ny = [int(value) for value in params.read().split()[:2]]
+
+    words = (nx + 31) // 32
+    bitmap = [0] * (words * ny)
+
+    with open(args.text_file) as text:
+        for number, line in enumerate(text, 1):
+            if not line.strip():
+                continue
+
+            xx, yy, blocked = [int(value) for value in line.split()]
+
+            if not (0 <= xx < nx and 0 <= yy < ny) or blocked != 1:
+                raise SystemExit("%s:%d: bad obstacle %s" %
+                                 (args.text_file, number, line.strip()))
+
+            bitmap[yy * words + xx // 32] |= 1 << (xx % 32)
+
+    binary_file = args.binary_file
+    if binary_file is None:
+        binary_file = args.text_file.rsplit(".", 1)[0] + ".bin"
+
+    with open(binary_file, "wb") as binary:
+        binary.write(MAGIC)
+        binary.write(struct.pack("=2i", nx, ny))
+        binary.write(struct.pack("=%dI" % len(bitmap), *bitmap))
+
+
+if __name__ == "__main__":
+    main()